@@ -0,0 +1,498 @@
+/*
+ * File       : pnmbench.c
+ * Description: Time the read_* and write_* functions of libpnmio on a set of
+ *              PBM, PGM, PPM, PAM or PFM images, reporting MB/s, pixels/s
+ *              and peak RSS in CSV or JSON form.
+ * Author     : Nikolaos Kavvadias <nikolaos.kavvadias@gmail.com>
+ * Copyright  : (C) Nikolaos Kavvadias 2014-2022
+ * Website    : http://www.nkavvadias.com
+ *
+ * This file is part of libpnmio, and is distributed under the terms of the
+ * Modified BSD License.
+ *
+ * A copy of the Modified BSD License is included with this distribution
+ * in the file LICENSE.
+ * libpnmio is free software: you can redistribute it and/or modify it under the
+ * terms of the Modified BSD License.
+ * libpnmio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the Modified BSD License for more details.
+ *
+ * You should have received a copy of the Modified BSD License along with
+ * libpnmio. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "pnmio.h"
+
+#define  MAXLINE         4096
+#define  MIN_REPS           3 /* repetitions of each case, at least */
+#define  MAX_REPS         100 /* repetitions of each case, at most */
+#define  MIN_TIME         0.2 /* seconds spent on each case, at least */
+
+#define  FAMILY_PBM         1
+#define  FAMILY_PGM         2
+#define  FAMILY_PPM         3
+#define  FAMILY_PAM         4
+#define  FAMILY_PFM         5
+
+/* A timed function: it reads or writes a whole image file. */
+typedef struct {
+  const char *name;
+  int family;
+  int is_write;
+} bench_case;
+
+/* One case per read_* and write_* function of the library. */
+static const bench_case cases[] = {
+  { "read_pbm_data",      FAMILY_PBM, 0 },
+  { "read_pbm_data_ex",   FAMILY_PBM, 0 },
+  { "read_pbm_data_mt",   FAMILY_PBM, 0 },
+  { "read_pbm_data_u8",   FAMILY_PBM, 0 },
+  { "write_pbm_file",     FAMILY_PBM, 1 },
+  { "write_pbm_file_mt",  FAMILY_PBM, 1 },
+  { "write_pbm_file_u8",  FAMILY_PBM, 1 },
+  { "read_pgm_data",      FAMILY_PGM, 0 },
+  { "read_pgm_data_ex",   FAMILY_PGM, 0 },
+  { "read_pgm_data_mt",   FAMILY_PGM, 0 },
+  { "read_pgm_data_u8",   FAMILY_PGM, 0 },
+  { "read_pgm_data_u16",  FAMILY_PGM, 0 },
+  { "write_pgm_file",     FAMILY_PGM, 1 },
+  { "write_pgm_file_mt",  FAMILY_PGM, 1 },
+  { "write_pgm_file_u8",  FAMILY_PGM, 1 },
+  { "write_pgm_file_u16", FAMILY_PGM, 1 },
+  { "read_ppm_data",      FAMILY_PPM, 0 },
+  { "read_ppm_data_ex",   FAMILY_PPM, 0 },
+  { "read_ppm_data_mt",   FAMILY_PPM, 0 },
+  { "read_ppm_data_u8",   FAMILY_PPM, 0 },
+  { "read_ppm_data_u16",  FAMILY_PPM, 0 },
+  { "write_ppm_file",     FAMILY_PPM, 1 },
+  { "write_ppm_file_mt",  FAMILY_PPM, 1 },
+  { "write_ppm_file_u8",  FAMILY_PPM, 1 },
+  { "write_ppm_file_u16", FAMILY_PPM, 1 },
+  { "read_pam_data",      FAMILY_PAM, 0 },
+  { "write_pam_file",     FAMILY_PAM, 1 },
+  { "read_pfm_data",      FAMILY_PFM, 0 },
+  { "write_pfm_file",     FAMILY_PFM, 1 },
+};
+
+/* The image under test, and the buffer of the case being run. */
+typedef struct {
+  const char *file_name;
+  char out_name[MAXLINE];
+  pnm_info info;
+  int family, is_ascii;
+  size_t n;                 /* samples */
+  long bytes;               /* size of the input file */
+  long raster;              /* bytes of the file after the header */
+  int *img;
+  uint8_t *img_u8;
+  uint16_t *img_u16;
+  float *img_f;
+} bench_img;
+
+/* Result of one case, passed from the child process that ran it. */
+typedef struct {
+  int ok;
+  int reps;
+  double best;              /* seconds of the fastest repetition */
+  long bytes;               /* bytes read or written per repetition */
+  long peak_rss;            /* KB */
+} bench_result;
+
+int enable_json=0;
+int num_threads=0;
+
+
+/* Print usage instructions for the "pnmbench" program.
+ */
+static void print_usage()
+{
+  printf("\n");
+  printf("* Usage:\n");
+  printf("* pnmbench [-csv|-json] [-t <num>] <infile> ...\n");
+  printf("* \n");
+  printf("* Options:\n");
+  printf("*   -h:              Print this help.\n");
+  printf("*   -csv:            Print the results as CSV (default).\n");
+  printf("*   -json:           Print the results as a JSON array.\n");
+  printf("*   -t <num>:        Threads for the *_mt functions (default: one\n");
+  printf("*                    per processor).\n");
+  printf("* \n");
+  printf("* Each read_* and write_* function that applies to an input file is\n");
+  printf("* timed in a process of its own; writes go to <infile>.out.\n");
+  printf("* \n");
+  printf("* For further information, please refer to the website:\n");
+  printf("* http://www.nkavvadias.com\n\n");
+}
+
+/* Return the time in seconds from a monotonic clock.
+ */
+static double now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+/* Return the family of a PNM/PAM/PFM type.
+ */
+static int family_of(int pnm_type)
+{
+  switch (pnm_type) {
+    case PBM_ASCII: case PBM_BINARY: return FAMILY_PBM;
+    case PGM_ASCII: case PGM_BINARY: return FAMILY_PGM;
+    case PPM_ASCII: case PPM_BINARY: return FAMILY_PPM;
+    case PAM:                        return FAMILY_PAM;
+    default:                         return FAMILY_PFM;
+  }
+}
+
+/* Run a read case once: the header and the raster of the input file.
+ */
+static void run_read(const bench_case *c, bench_img *b)
+{
+  pnm_info info;
+  FILE *f;
+  int x, y, colors, asc;
+
+  if ((f = fopen(b->file_name, "rb")) == NULL) {
+    fprintf(stderr, "Error: Can't open the specified input file.\n");
+    exit(1);
+  }
+  if (pnm_read_header(f, &info) != PNM_OK) {
+    fprintf(stderr, "Error: Unknown PNM/PFM image format. Exiting...\n");
+    exit(1);
+  }
+  x      = info.width;
+  y      = info.height;
+  colors = info.maxval;
+  asc    = (info.pnm_type <= PPM_ASCII) ? 1 : 0;
+  if (strcmp(c->name, "read_pbm_data") == 0) {
+    read_pbm_data(f, b->img, asc);
+  } else if (strcmp(c->name, "read_pbm_data_ex") == 0) {
+    read_pbm_data_ex(f, b->img, x, y, asc);
+  } else if (strcmp(c->name, "read_pbm_data_mt") == 0) {
+    read_pbm_data_mt(f, b->img, x, y, asc, num_threads);
+  } else if (strcmp(c->name, "read_pbm_data_u8") == 0) {
+    read_pbm_data_u8(f, b->img_u8, x, y, asc);
+  } else if (strcmp(c->name, "read_pgm_data") == 0) {
+    read_pgm_data(f, b->img, asc);
+  } else if (strcmp(c->name, "read_pgm_data_ex") == 0) {
+    read_pgm_data_ex(f, b->img, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_pgm_data_mt") == 0) {
+    read_pgm_data_mt(f, b->img, x, y, colors, asc, num_threads);
+  } else if (strcmp(c->name, "read_pgm_data_u8") == 0) {
+    read_pgm_data_u8(f, b->img_u8, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_pgm_data_u16") == 0) {
+    read_pgm_data_u16(f, b->img_u16, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_ppm_data") == 0) {
+    read_ppm_data(f, b->img, asc);
+  } else if (strcmp(c->name, "read_ppm_data_ex") == 0) {
+    read_ppm_data_ex(f, b->img, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_ppm_data_mt") == 0) {
+    read_ppm_data_mt(f, b->img, x, y, colors, asc, num_threads);
+  } else if (strcmp(c->name, "read_ppm_data_u8") == 0) {
+    read_ppm_data_u8(f, b->img_u8, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_ppm_data_u16") == 0) {
+    read_ppm_data_u16(f, b->img_u16, x, y, colors, asc);
+  } else if (strcmp(c->name, "read_pam_data") == 0) {
+    read_pam_data(f, b->img, x, y, info.depth, colors);
+  } else if (strcmp(c->name, "read_pfm_data") == 0) {
+    read_pfm_data(f, b->img_f, (info.pnm_type == PFM_RGB) ? 1 : 0,
+      info.endianess);
+  }
+  fclose(f);
+}
+
+/* Run a write case once: the whole output file, flushed and closed.
+ */
+static void run_write(const bench_case *c, bench_img *b)
+{
+  FILE *f;
+  int x = b->info.width, y = b->info.height, colors = b->info.maxval;
+  int asc = b->is_ascii;
+
+  if ((f = fopen(b->out_name, "wb")) == NULL) {
+    fprintf(stderr, "Error: Can't create the specified output file.\n");
+    exit(1);
+  }
+  if (strcmp(c->name, "write_pbm_file") == 0) {
+    write_pbm_file(f, b->img, x, y, 1, 1, 32, asc);
+  } else if (strcmp(c->name, "write_pbm_file_mt") == 0) {
+    write_pbm_file_mt(f, b->img, x, y, 1, 1, 32, asc, num_threads);
+  } else if (strcmp(c->name, "write_pbm_file_u8") == 0) {
+    write_pbm_file_u8(f, b->img_u8, x, y, 1, 1, 32, asc);
+  } else if (strcmp(c->name, "write_pgm_file") == 0) {
+    write_pgm_file(f, b->img, x, y, 1, 1, colors, 16, asc);
+  } else if (strcmp(c->name, "write_pgm_file_mt") == 0) {
+    write_pgm_file_mt(f, b->img, x, y, 1, 1, colors, 16, asc, num_threads);
+  } else if (strcmp(c->name, "write_pgm_file_u8") == 0) {
+    write_pgm_file_u8(f, b->img_u8, x, y, 1, 1, colors, 16, asc);
+  } else if (strcmp(c->name, "write_pgm_file_u16") == 0) {
+    write_pgm_file_u16(f, b->img_u16, x, y, 1, 1, colors, 16, asc);
+  } else if (strcmp(c->name, "write_ppm_file") == 0) {
+    write_ppm_file(f, b->img, x, y, 1, 1, colors, asc);
+  } else if (strcmp(c->name, "write_ppm_file_mt") == 0) {
+    write_ppm_file_mt(f, b->img, x, y, 1, 1, colors, asc, num_threads);
+  } else if (strcmp(c->name, "write_ppm_file_u8") == 0) {
+    write_ppm_file_u8(f, b->img_u8, x, y, 1, 1, colors, asc);
+  } else if (strcmp(c->name, "write_ppm_file_u16") == 0) {
+    write_ppm_file_u16(f, b->img_u16, x, y, 1, 1, colors, asc);
+  } else if (strcmp(c->name, "write_pam_file") == 0) {
+    write_pam_file(f, b->img, x, y, b->info.depth, colors, b->info.tupltype);
+  } else if (strcmp(c->name, "write_pfm_file") == 0) {
+    write_pfm_file(f, b->img_f, x, y, (b->info.pnm_type == PFM_RGB) ? 1 : 0,
+      b->info.endianess);
+  }
+  fclose(f);
+}
+
+/* Return 1 if a case cannot read or write the input image: the _u8 and 
+ * the legacy read_pgm_data/read_ppm_data functions only handle 8-bit 
+ * samples.
+ */
+static int skip_case(const bench_case *c, const bench_img *b)
+{
+  return (b->info.maxval > 255) &&
+         ((strstr(c->name, "_u8") != NULL) ||
+          (strcmp(c->name, "read_pgm_data") == 0) ||
+          (strcmp(c->name, "read_ppm_data") == 0));
+}
+
+/* Read the header of the input image. Returns 0 if it cannot be read.
+ */
+static int probe_image(bench_img *b)
+{
+  FILE *f;
+  int err;
+
+  if ((f = fopen(b->file_name, "rb")) == NULL) {
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  b->bytes = ftell(f);
+  rewind(f);
+  err = pnm_read_header(f, &b->info);
+  b->raster = b->bytes - ftell(f);
+  fclose(f);
+  b->family   = family_of(b->info.pnm_type);
+  b->is_ascii = (b->info.pnm_type <= PPM_ASCII) ? 1 : 0;
+  b->n        = (size_t)b->info.width * b->info.height * b->info.depth;
+  snprintf(b->out_name, sizeof(b->out_name), "%s.out", b->file_name);
+  return (err == PNM_OK);
+}
+
+/* Allocate the one buffer a case needs and, for write cases, decode the 
+ * input image into it. Returns 0 on failure.
+ */
+static int load_image(const bench_case *c, bench_img *b)
+{
+  FILE *f;
+  void *buf;
+  size_t n;
+  int err, sample_type;
+
+  if (b->family == FAMILY_PFM) {
+    sample_type = PNM_SAMPLE_FLOAT;
+    buf = b->img_f = malloc(b->n * sizeof(float));
+  } else if (strstr(c->name, "_u16") != NULL) {
+    sample_type = PNM_SAMPLE_U16;
+    buf = b->img_u16 = malloc(b->n * sizeof(uint16_t));
+  } else if (strstr(c->name, "_u8") != NULL) {
+    sample_type = PNM_SAMPLE_U8;
+    buf = b->img_u8 = malloc(b->n * sizeof(uint8_t));
+  } else {
+    /* read_pbm_data stores eight ints per raster byte, padding bits 
+     * included, and reads up to the end of the file.
+     */
+    sample_type = PNM_SAMPLE_INT;
+    n = b->n;
+    if ((b->family == FAMILY_PBM) && (n < 8 * (size_t)b->raster)) {
+      n = 8 * (size_t)b->raster;
+    }
+    buf = b->img = malloc(n * sizeof(int));
+  }
+  if (buf == NULL) {
+    return 0;
+  }
+  if (!c->is_write) {
+    return 1;
+  }
+  if ((f = fopen(b->file_name, "rb")) == NULL) {
+    return 0;
+  }
+  if ((err = pnm_read_header(f, &b->info)) == PNM_OK) {
+    err = pnm_ctx_read_data(NULL, f, &b->info, buf, sample_type);
+  }
+  fclose(f);
+  return (err == PNM_OK);
+}
+
+/* Run a case in a child process, so that its peak RSS is its own, and
+ * collect the result through a pipe. The image is loaded by the child.
+ */
+static void run_case(const bench_case *c, bench_img *b, bench_result *r)
+{
+  struct rusage ru;
+  double t, total = 0.0;
+  int fd[2], status;
+  FILE *f;
+  pid_t pid;
+
+  memset(r, 0, sizeof(*r));
+  if (pipe(fd) != 0) {
+    return;
+  }
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close(fd[0]);
+    if (!load_image(c, b)) {
+      _exit(1);
+    }
+    r->best = -1.0;
+    while ((r->reps < MAX_REPS) &&
+           ((total < MIN_TIME) || (r->reps < MIN_REPS))) {
+      t = now();
+      if (c->is_write) {
+        run_write(c, b);
+      } else {
+        run_read(c, b);
+      }
+      t = now() - t;
+      total += t;
+      if ((r->best < 0.0) || (t < r->best)) {
+        r->best = t;
+      }
+      r->reps++;
+    }
+    r->bytes = b->bytes;
+    if (c->is_write && ((f = fopen(b->out_name, "rb")) != NULL)) {
+      fseek(f, 0, SEEK_END);
+      r->bytes = ftell(f);
+      fclose(f);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    r->peak_rss = ru.ru_maxrss;
+    r->ok = 1;
+    if (write(fd[1], r, sizeof(*r)) != (ssize_t)sizeof(*r)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(fd[1]);
+  if ((pid < 0) || (read(fd[0], r, sizeof(*r)) != (ssize_t)sizeof(*r))) {
+    r->ok = 0;
+  }
+  close(fd[0]);
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+}
+
+/* Print one result line.
+ */
+static void print_result(const bench_case *c, const bench_img *b,
+  const bench_result *r, int first)
+{
+  static const char *formats[] = { "", "pbm", "pgm", "ppm", "pam", "pfm" };
+  const char *encoding = (b->family == FAMILY_PFM) ? "float" :
+                         (b->is_ascii ? "ascii" : "binary");
+  double pixels = (double)b->info.width * b->info.height;
+
+  if (enable_json == 1) {
+    printf("%s  {\"function\": \"%s\", \"format\": \"%s\", "
+      "\"encoding\": \"%s\", \"width\": %d, \"height\": %d, \"bytes\": %ld, "
+      "\"reps\": %d, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+      "\"pixels_per_s\": %.0f, \"peak_rss_kb\": %ld}", first ? "" : ",\n",
+      c->name, formats[b->family], encoding, b->info.width, b->info.height,
+      r->bytes, r->reps, r->best, r->bytes / r->best / 1e6, pixels / r->best,
+      r->peak_rss);
+  } else {
+    printf("%s,%s,%s,%d,%d,%ld,%d,%.6f,%.2f,%.0f,%ld\n", c->name,
+      formats[b->family], encoding, b->info.width, b->info.height, r->bytes,
+      r->reps, r->best, r->bytes / r->best / 1e6, pixels / r->best,
+      r->peak_rss);
+  }
+}
+
+/* The main "pnmbench" routine.
+ */
+int main(int argc, char **argv)
+{
+  bench_img b;
+  bench_result r;
+  size_t k;
+  int i, loaded, first=1, failed=0;
+
+  // Read input arguments
+  if (argc < 2) {
+    print_usage();
+    exit(1);
+  }
+
+  for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+    if (strcmp("-h", argv[i]) == 0) {
+      print_usage();
+      exit(1);
+    } else if (strcmp("-csv", argv[i]) == 0) {
+      enable_json = 0;
+    } else if (strcmp("-json", argv[i]) == 0) {
+      enable_json = 1;
+    } else if (strcmp("-t", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        num_threads = atoi(argv[i]);
+      }
+    } else {
+      fprintf(stderr, "Error: Unknown command-line option.\n");
+      exit(1);
+    }
+  }
+
+  if (enable_json == 1) {
+    printf("[\n");
+  } else {
+    printf("function,format,encoding,width,height,bytes,reps,seconds,"
+      "mb_per_s,pixels_per_s,peak_rss_kb\n");
+  }
+  for (; i < argc; i++) {
+    memset(&b, 0, sizeof(b));
+    b.file_name = argv[i];
+    if (!(loaded = probe_image(&b))) {
+      fprintf(stderr, "Error: %s: Can't read the input file.\n", argv[i]);
+      failed = 1;
+    }
+    for (k = 0; loaded && (k < sizeof(cases) / sizeof(cases[0])); k++) {
+      if ((cases[k].family != b.family) || skip_case(&cases[k], &b)) {
+        continue;
+      }
+      run_case(&cases[k], &b, &r);
+      if (!r.ok) {
+        fprintf(stderr, "Error: %s: %s failed.\n", argv[i], cases[k].name);
+        failed = 1;
+        continue;
+      }
+      print_result(&cases[k], &b, &r, first);
+      first = 0;
+    }
+    if (loaded) {
+      remove(b.out_name);
+    }
+  }
+  if (enable_json == 1) {
+    printf("\n]\n");
+  }
+
+  return failed;
+}
@@ -0,0 +1,652 @@
+/*
+ * File       : pnmconv.c
+ * Description: Convert batches of PBM, PGM, PPM or PFM images between the
+ *              ASCII and binary encodings and between the PNM variants,
+ *              and tone map PFM images to PPM/PGM, using a work-stealing 
+ *              pool of threads.
+ * Author     : Nikolaos Kavvadias <nikolaos.kavvadias@gmail.com>
+ * Copyright  : (C) Nikolaos Kavvadias 2014-2022
+ * Website    : http://www.nkavvadias.com
+ *
+ * This file is part of libpnmio, and is distributed under the terms of the
+ * Modified BSD License.
+ *
+ * A copy of the Modified BSD License is included with this distribution
+ * in the file LICENSE.
+ * libpnmio is free software: you can redistribute it and/or modify it under the
+ * terms of the Modified BSD License.
+ * libpnmio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the Modified BSD License for more details.
+ *
+ * You should have received a copy of the Modified BSD License along with
+ * libpnmio. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "pnmio.h"
+
+#define  MAX_THREADS       64
+#define  MAXLINE         4096
+
+#define  KEEP_ENCODING      0
+#define  TO_ASCII           1
+#define  TO_BINARY          2
+
+/* A queue of files for one thread: the owner takes files from the head,
+ * other threads steal them from the tail.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  int head, tail;
+} file_queue;
+
+/* Per-thread state: buffers reused from one image to the next, and
+ * statistics.
+ */
+typedef struct {
+  int id;
+  pnm_ctx ctx;
+  pnm_batch *batch;         /* read-ahead of the own queue */
+  const char *file_name;    /* file being converted, for messages */
+  void *in, *out;           /* sample buffers */
+  size_t in_size, out_size;
+  long files, failed, stolen;
+  double bytes_in, bytes_out, pixels;
+} worker;
+
+int target_type=0;          /* 0: keep the variant */
+int target_encoding=KEEP_ENCODING;
+int num_threads=0;
+int read_ahead=4;
+int enable_tonemap=0;
+float tone_exposure=0.0f, tone_gamma=0.0f;
+int tone_maxval=255;
+int tone_threads=1;         /* threads per tone mapped image */
+char *outdir_name=NULL;
+char **file_names=NULL;
+int num_files=0, max_files=0;
+file_queue queue[MAX_THREADS];
+worker workers[MAX_THREADS];
+
+
+/* Print usage instructions for the "pnmconv" program.
+ */
+static void print_usage()
+{
+  printf("\n");
+  printf("* Usage:\n");
+  printf("* pnmconv [options] -o <outdir> [<infile> ...]\n");
+  printf("* \n");
+  printf("* Options:\n");
+  printf("*   -h:              Print this help.\n");
+  printf("*   -ascii:          Write PNM images in the ASCII format.\n");
+  printf("*   -binary:         Write PNM images in the binary format.\n");
+  printf("*                    (default: keep the format of each input).\n");
+  printf("*   -pbm:            Convert PNM images to PBM (threshold at maxval/2).\n");
+  printf("*   -pgm:            Convert PNM images to PGM (luma of PPM pixels).\n");
+  printf("*   -ppm:            Convert PNM images to PPM.\n");
+  printf("*                    (default: keep the variant of each input).\n");
+  printf("*   -d <dir>:        Convert the PNM/PFM files of directory <dir>.\n");
+  printf("*   -l <listfile>:   Convert the files listed in <listfile>, one per\n");
+  printf("*                    line (- for stdin).\n");
+  printf("*   -o <outdir>:     Write the converted files to directory <outdir>,\n");
+  printf("*                    under their original names.\n");
+  printf("*   -t <num>:        Use <num> threads (default: one per processor).\n");
+  printf("*   -r <num>:        Open and read ahead <num> files per thread\n");
+  printf("*                    (default: 4; 0 to disable).\n");
+  printf("*   -tonemap:        Tone map PFM images to binary PPM/PGM images,\n");
+  printf("*                    named <name>.ppm/<name>.pgm.\n");
+  printf("*   -exposure <num>: Scale PFM samples by 2^<num> (default: 0).\n");
+  printf("*   -gamma <num>:    Apply x^(1/<num>) to tone mapped samples\n");
+  printf("*                    (default: 0, for the sRGB curve).\n");
+  printf("*   -maxval <num>:   Maxval of tone mapped images (default: 255;\n");
+  printf("*                    16-bit samples above 255).\n");
+  printf("* \n");
+  printf("* For further information, please refer to the website:\n");
+  printf("* http://www.nkavvadias.com\n\n");
+}
+
+/* Add a file name to the list of files to convert.
+ */
+static void add_file(const char *name)
+{
+  if (num_files == max_files) {
+    max_files  = (max_files > 0) ? 2 * max_files : 256;
+    file_names = realloc(file_names, max_files * sizeof(char *));
+    if (file_names == NULL) {
+      fprintf(stderr, "Error: Out of memory!\n");
+      exit(1);
+    }
+  }
+  file_names[num_files] = malloc(strlen(name) + 1);
+  if (file_names[num_files] == NULL) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  strcpy(file_names[num_files++], name);
+}
+
+/* Add the files named in a list file, one per line.
+ */
+static void add_list_file(const char *list_name)
+{
+  char line[MAXLINE];
+  FILE *f;
+  size_t len;
+
+  if (strcmp(list_name, "-") == 0) {
+    f = stdin;
+  } else if ((f = fopen(list_name, "r")) == NULL) {
+    fprintf(stderr, "Error: Can't open the specified list file.\n");
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    len = strlen(line);
+    while ((len > 0) && ((line[len-1] == '\n') || (line[len-1] == '\r'))) {
+      line[--len] = '\0';
+    }
+    if (len > 0) {
+      add_file(line);
+    }
+  }
+  if (f != stdin) {
+    fclose(f);
+  }
+}
+
+/* Compare two file names for qsort.
+ */
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Add the PNM/PFM files of a directory, in name order.
+ */
+static void add_dir_files(const char *dir_name)
+{
+  static const char *ext[] = {".pbm", ".pgm", ".ppm", ".pnm", ".pam", ".pfm"};
+  char path[MAXLINE];
+  struct dirent *e;
+  DIR *d;
+  size_t len;
+  int first = num_files, k;
+
+  if ((d = opendir(dir_name)) == NULL) {
+    fprintf(stderr, "Error: Can't open the specified input directory.\n");
+    exit(1);
+  }
+  while ((e = readdir(d)) != NULL) {
+    len = strlen(e->d_name);
+    for (k = 0; k < 6; k++) {
+      if ((len > 4) && (strcmp(e->d_name + len - 4, ext[k]) == 0)) {
+        snprintf(path, sizeof(path), "%s/%s", dir_name, e->d_name);
+        add_file(path);
+        break;
+      }
+    }
+  }
+  closedir(d);
+  qsort(file_names + first, num_files - first, sizeof(char *), compare_names);
+}
+
+/* Return the length of the output name of a file: that of its base name, 
+ * less the extension of a PFM file that is tone mapped.
+ */
+static size_t out_name_len(const char *base)
+{
+  const char *dot = strrchr(base, '.');
+
+  if ((enable_tonemap == 1) && (dot != NULL) && (strcmp(dot, ".pfm") == 0)) {
+    return (size_t)(dot - base);
+  }
+  return strlen(base);
+}
+
+/* Compare the output names of two files for qsort.
+ */
+static int compare_out_names(const void *a, const void *b)
+{
+  const char *p = *(char * const *)a, *q = *(char * const *)b;
+  size_t m, n;
+  int cmp;
+
+  p   = (strrchr(p, '/') != NULL) ? strrchr(p, '/') + 1 : p;
+  q   = (strrchr(q, '/') != NULL) ? strrchr(q, '/') + 1 : q;
+  m   = out_name_len(p);
+  n   = out_name_len(q);
+  cmp = strncmp(p, q, (m < n) ? m : n);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (m > n) - (m < n);
+}
+
+/* Exit with an error if two input files would be written to the same 
+ * output file, since all of them are written to one directory by base name.
+ */
+static void check_out_names(void)
+{
+  char **names;
+  int i;
+
+  if (num_files < 2) {
+    return;
+  }
+  names = malloc(num_files * sizeof(char *));
+  if (names == NULL) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  memcpy(names, file_names, num_files * sizeof(char *));
+  qsort(names, num_files, sizeof(char *), compare_out_names);
+  for (i = 1; i < num_files; i++) {
+    if (compare_out_names(&names[i-1], &names[i]) == 0) {
+      fprintf(stderr, "Error: %s and %s have the same output name.\n",
+        names[i-1], names[i]);
+      exit(1);
+    }
+  }
+  free(names);
+}
+
+/* Print the messages of the library, prefixed by the file name.
+ */
+static void log_message(void *user, int level, const char *msg)
+{
+  worker *w = user;
+
+  if (level == PNM_LOG_ERROR) {
+    fprintf(stderr, "Error: %s: %s\n", w->file_name, msg);
+  }
+}
+
+/* Make sure that a per-thread buffer holds at least size bytes.
+ */
+static int reserve(void **buf, size_t *buf_size, size_t size)
+{
+  void *p;
+
+  if (size > *buf_size) {
+    if ((p = realloc(*buf, size)) == NULL) {
+      return PNM_ERR_NOMEM;
+    }
+    *buf      = p;
+    *buf_size = size;
+  }
+  return PNM_OK;
+}
+
+/* Convert the int samples of a PNM image to another variant. The PBM
+ * convention (1 for black) is taken into account.
+ */
+static void convert_variant(const int *src, const pnm_info *in, int *dst,
+  const pnm_info *out)
+{
+  size_t i, n = (size_t)in->width * in->height;
+  int v, in_pbm = (in->pnm_type == PBM_ASCII) || (in->pnm_type == PBM_BINARY);
+
+  for (i = 0; i < n; i++) {
+    if (in_pbm) {
+      v = src[i] ? 0 : out->maxval;
+    } else if (in->depth == 3) {
+      v = (299*src[3*i+0] + 587*src[3*i+1] + 114*src[3*i+2] + 500) / 1000;
+    } else {
+      v = src[i];
+    }
+    if ((out->pnm_type == PBM_ASCII) || (out->pnm_type == PBM_BINARY)) {
+      dst[i] = in_pbm ? src[i] : (2*v < in->maxval + 1);
+    } else if (out->depth == 3) {
+      dst[3*i+0] = dst[3*i+1] = dst[3*i+2] = v;
+    } else {
+      dst[i] = v;
+    }
+  }
+}
+
+/* Tone map the PFM image of fin, described by in, to out_name with the 
+ * extension replaced by .ppm or .pgm.
+ */
+static int tonemap_file(worker *w, FILE *fin, const pnm_info *in, 
+  char *out_name)
+{
+  char *dot = strrchr(out_name, '.'), *slash = strrchr(out_name, '/');
+  FILE *fout;
+  int err;
+
+  if ((dot == NULL) || ((slash != NULL) && (dot < slash))) {
+    dot = out_name + strlen(out_name);
+  }
+  if ((size_t)(dot - out_name) + 5 > MAXLINE) {
+    fclose(fin);
+    return PNM_ERR_RANGE;
+  }
+  strcpy(dot, (in->pnm_type == PFM_RGB) ? ".ppm" : ".pgm");
+  if ((fout = fopen(out_name, "wb")) == NULL) {
+    fprintf(stderr, "Error: %s: Can't create the output file.\n", out_name);
+    fclose(fin);
+    return PNM_ERR_IO;
+  }
+  /* The header is read again as part of the conversion. */
+  rewind(fin);
+  err = pnm_tonemap_pfm(fin, fout, tone_exposure, tone_gamma, tone_maxval,
+          tone_threads);
+  w->bytes_in  += (double)ftell(fin);
+  w->bytes_out += (double)ftell(fout);
+  fclose(fin);
+  if ((fclose(fout) != 0) && (err == PNM_OK)) {
+    err = PNM_ERR_IO;
+  }
+  if (err != PNM_OK) {
+    fprintf(stderr, "Error: %s: %s\n", w->file_name, pnm_strerror(err));
+  } else {
+    w->pixels += (double)in->width * in->height;
+  }
+  return err;
+}
+
+/* Convert one file, which may have been opened already as fin. 
+ * Returns PNM_OK or a negative error code.
+ */
+static int convert_file(worker *w, const char *in_name, FILE *fin)
+{
+  char out_name[MAXLINE];
+  const char *base;
+  pnm_info in, out;
+  FILE *fout;
+  size_t n, size;
+  int family, is_pfm, sample_type, err;
+  void *buf;
+
+  w->file_name = in_name;
+  base = strrchr(in_name, '/');
+  base = (base != NULL) ? base + 1 : in_name;
+  snprintf(out_name, sizeof(out_name), "%s/%s", outdir_name, base);
+
+  if ((fin == NULL) && ((fin = fopen(in_name, "rb")) == NULL)) {
+    fprintf(stderr, "Error: %s: Can't open the input file.\n", in_name);
+    return PNM_ERR_IO;
+  }
+  if ((err = pnm_ctx_read_header(&w->ctx, fin, &in)) != PNM_OK) {
+    fclose(fin);
+    return err;
+  }
+  is_pfm      = (in.pnm_type == PFM_RGB) || (in.pnm_type == PFM_GREYSCALE);
+  if (is_pfm && (enable_tonemap == 1)) {
+    return tonemap_file(w, fin, &in, out_name);
+  }
+  sample_type = is_pfm ? PNM_SAMPLE_FLOAT : PNM_SAMPLE_INT;
+  n    = (size_t)in.width * in.height * in.depth;
+  size = n * pnm_sample_size(sample_type);
+  if ((err = reserve(&w->in, &w->in_size, size)) != PNM_OK) {
+    fclose(fin);
+    return err;
+  }
+  err = pnm_ctx_read_data(&w->ctx, fin, &in, w->in, sample_type);
+  w->bytes_in += (double)ftell(fin);
+  fclose(fin);
+  if (err != PNM_OK) {
+    return err;
+  }
+
+  /* Work out the type of the output image; PFM and PAM images are written
+   * back unchanged.
+   */
+  out = in;
+  buf = w->in;
+  if (!is_pfm && (in.pnm_type != PAM)) {
+    family = (in.pnm_type - 1) % 3 + 1;
+    if (target_type != 0) {
+      family = target_type;
+    }
+    if (target_encoding == TO_ASCII) {
+      out.pnm_type = family;
+    } else if (target_encoding == TO_BINARY) {
+      out.pnm_type = family + 3;
+    } else {
+      out.pnm_type = (in.pnm_type <= PPM_ASCII) ? family : family + 3;
+    }
+    out.depth  = (family == PPM_ASCII) ? 3 : 1;
+    out.maxval = (family == PBM_ASCII) ? 1 :
+                 ((in.pnm_type == PBM_ASCII) || (in.pnm_type == PBM_BINARY)) ? 
+                 255 : in.maxval;
+    if ((out.pnm_type - 1) % 3 != (in.pnm_type - 1) % 3) {
+      size = (size_t)out.width * out.height * out.depth * sizeof(int);
+      if ((err = reserve(&w->out, &w->out_size, size)) != PNM_OK) {
+        return err;
+      }
+      convert_variant(w->in, &in, w->out, &out);
+      buf = w->out;
+    }
+  }
+
+  if ((fout = fopen(out_name, "wb")) == NULL) {
+    fprintf(stderr, "Error: %s: Can't create the output file.\n", out_name);
+    return PNM_ERR_IO;
+  }
+  err = pnm_ctx_write(&w->ctx, fout, &out, buf, sample_type);
+  w->bytes_out += (double)ftell(fout);
+  if ((fclose(fout) != 0) && (err == PNM_OK)) {
+    err = PNM_ERR_IO;
+  }
+  w->pixels += (double)in.width * in.height;
+  return err;
+}
+
+/* Take the next file from the own queue of a thread, or else steal one
+ * from the tail of the queue of another thread. Files of the own queue 
+ * come in order, so they are the ones read ahead. Returns -1 once all 
+ * queues are empty.
+ */
+static int next_file(worker *w, FILE **fin)
+{
+  file_queue *q;
+  int k, idx = -1;
+
+  q = &queue[w->id];
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    idx = q->head++;
+  }
+  pthread_mutex_unlock(&q->lock);
+  *fin = NULL;
+  if ((idx >= 0) && (w->batch != NULL)) {
+    pnm_batch_next(w->batch, fin);
+  }
+  for (k = 1; (idx < 0) && (k < num_threads); k++) {
+    q = &queue[(w->id + k) % num_threads];
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+      idx = --q->tail;
+      w->stolen++;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return idx;
+}
+
+/* Convert files until there are none left.
+ */
+static void *run_worker(void *arg)
+{
+  worker *w = arg;
+  FILE *fin;
+  int idx;
+
+  while ((idx = next_file(w, &fin)) >= 0) {
+    if (convert_file(w, file_names[idx], fin) == PNM_OK) {
+      w->files++;
+    } else {
+      w->failed++;
+    }
+  }
+  return NULL;
+}
+
+/* The main "pnmconv" routine.
+ */
+int main(int argc, char **argv)
+{
+  pthread_t tid[MAX_THREADS];
+  struct timespec t0, t1;
+  double secs, bytes_in=0.0, bytes_out=0.0, pixels=0.0;
+  long files=0, failed=0;
+  int i, t;
+
+  // Read input arguments
+  if (argc < 2) {
+    print_usage();
+    exit(1);
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp("-h", argv[i]) == 0) {
+      print_usage();
+      exit(1);
+    } else if (strcmp("-ascii", argv[i]) == 0) {
+      target_encoding = TO_ASCII;
+    } else if (strcmp("-binary", argv[i]) == 0) {
+      target_encoding = TO_BINARY;
+    } else if (strcmp("-pbm", argv[i]) == 0) {
+      target_type = PBM_ASCII;
+    } else if (strcmp("-pgm", argv[i]) == 0) {
+      target_type = PGM_ASCII;
+    } else if (strcmp("-ppm", argv[i]) == 0) {
+      target_type = PPM_ASCII;
+    } else if (strcmp("-d", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        add_dir_files(argv[i]);
+      }
+    } else if (strcmp("-l", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        add_list_file(argv[i]);
+      }
+    } else if (strcmp("-o", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        outdir_name = argv[i];
+      }
+    } else if (strcmp("-t", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        num_threads = atoi(argv[i]);
+      }
+    } else if (strcmp("-r", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        read_ahead = atoi(argv[i]);
+      }
+    } else if (strcmp("-tonemap", argv[i]) == 0) {
+      enable_tonemap = 1;
+    } else if (strcmp("-exposure", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        tone_exposure = (float)atof(argv[i]);
+      }
+    } else if (strcmp("-gamma", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        tone_gamma = (float)atof(argv[i]);
+      }
+    } else if (strcmp("-maxval", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        tone_maxval = atoi(argv[i]);
+      }
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Error: Unknown command-line option.\n");
+      exit(1);
+    } else {
+      add_file(argv[i]);
+    }
+  }
+  if (outdir_name == NULL) {
+    fprintf(stderr, "Error: No output directory given.\n");
+    exit(1);
+  }
+  check_out_names();
+  if (num_threads <= 0) {
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  } else if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  if (num_threads > num_files) {
+    /* Spare threads go to the tone mapping of each image. */
+    tone_threads = (num_files > 0) ? num_threads / num_files : 1;
+    num_threads  = (num_files > 0) ? num_files : 1;
+  }
+
+  /* Deal the files out to the threads in contiguous runs. */
+  for (t = 0; t < num_threads; t++) {
+    pthread_mutex_init(&queue[t].lock, NULL);
+    queue[t].head = (int)((long)num_files * t / num_threads);
+    queue[t].tail = (int)((long)num_files * (t + 1) / num_threads);
+    memset(&workers[t], 0, sizeof(worker));
+    workers[t].id = t;
+    pnm_ctx_init(&workers[t].ctx);
+    pnm_ctx_set_log(&workers[t].ctx, log_message, &workers[t]);
+    if ((read_ahead > 0) && 
+        (pnm_batch_open(&workers[t].batch, 
+           (const char * const *)file_names + queue[t].head, 
+           queue[t].tail - queue[t].head, read_ahead) != PNM_OK)) {
+      workers[t].batch = NULL;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (t = 1; t < num_threads; t++) {
+    if (pthread_create(&tid[t], NULL, run_worker, &workers[t]) != 0) {
+      fprintf(stderr, "Error: Can't create a worker thread.\n");
+      exit(1);
+    }
+  }
+  run_worker(&workers[0]);
+  for (t = 1; t < num_threads; t++) {
+    pthread_join(tid[t], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+  if (secs <= 0.0) {
+    secs = 1e-9;
+  }
+
+  /* Print aggregate throughput statistics. */
+  for (t = 0; t < num_threads; t++) {
+    files     += workers[t].files;
+    failed    += workers[t].failed;
+    bytes_in  += workers[t].bytes_in;
+    bytes_out += workers[t].bytes_out;
+    pixels    += workers[t].pixels;
+    fprintf(stderr, "Info: thread %d: %ld files (%ld stolen)\n", t,
+      workers[t].files + workers[t].failed, workers[t].stolen);
+    pnm_batch_close(workers[t].batch);
+    free(workers[t].in);
+    free(workers[t].out);
+    pthread_mutex_destroy(&queue[t].lock);
+  }
+  fprintf(stderr, "Info: converted %ld of %d files (%ld failed) in %.3f s "
+    "with %d threads\n", files, num_files, failed, secs, num_threads);
+  fprintf(stderr, "Info: %.1f files/s, %.2f MB/s read, %.2f MB/s written, "
+    "%.2f Mpixels/s\n", files / secs, bytes_in / secs / 1e6,
+    bytes_out / secs / 1e6, pixels / secs / 1e6);
+
+  for (i = 0; i < num_files; i++) {
+    free(file_names[i]);
+  }
+  free(file_names);
+  return (failed > 0) ? 1 : 0;
+}
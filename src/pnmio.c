@@ -20,19 +20,876 @@
  * libpnmio. If not, see <http://www.gnu.org/licenses/>. 
  */
 
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#else
+#include <malloc.h>
+#endif
 #include "pnmio.h"
+#include "pnmsimd.h"
+
+#define  IOBUF_SIZE     65536 /* block size for binary payload I/O */
+#define  ASCIIBUF_SIZE 262144 /* block size for ASCII payload input */
+#define  ASCII_MAXTOKEN    32 /* longest ASCII token parsed in one piece */
+#define  ASCII_MT_BLOCK (32 << 20) /* ASCII payload bytes per parallel pass */
+#define  ASCII_MT_JOB   65536 /* samples per parallel encoding job */
+#define  ASCII_MAXBYTES    13 /* longest "%d " sample plus a line break */
+#define  PNM_MAX_THREADS   64
+#define  TONE_BAND   (4 << 20) /* PFM bytes per tone mapping pass */
 
-#define  MAXLINE         1024
+#define  IS_SPACE(c)  (((c) == ' ') || ((unsigned char)((c) - '\t') <= 4))
 #define  LITTLE_ENDIAN     -1
 #define  BIG_ENDIAN         1
+#define  LOG_MAXLEN       256 /* longest message passed to a log callback */
 #define  GREYSCALE_TYPE     0 /* used for PFM */
 #define  RGB_TYPE           1 /* used for PFM */   
+#define  STAT_FIELDS  (sizeof(pnm_stats) / sizeof(uint64_t))
+#define  MAX_SAMPLE_SIZE  ((sizeof(int) > sizeof(float)) ? sizeof(int) : sizeof(float))
+
+/* 64-bit file offsets, for files larger than 2 GB. */
+#if !defined(_WIN32)
+#define  FSEEK  fseeko
+#define  FTELL  ftello
+typedef off_t file_off;
+#else
+#define  FSEEK  _fseeki64
+#define  FTELL  _ftelli64
+typedef int64_t file_off;
+#endif
+
+/* Statistics. Each thread counts into a slot of its own, found through a 
+ * thread-specific key, and pnm_stats_get sums the slots. A slot is only 
+ * written by its own thread, with relaxed atomic stores where available, 
+ * so that other threads may read it at any time. The slots of exited 
+ * threads are folded into stats_retired; pnm_stats_reset takes a snapshot 
+ * of the sum (stats_base), which later sums are counted from.
+ */
+
+#if defined(__GNUC__)
+#define  STAT_LOAD(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define  STAT_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define  STAT_LOAD(p)      (*(p))
+#define  STAT_STORE(p, v)  (*(p) = (v))
+#endif
+
+/* Statistics of one thread. */
+typedef struct stats_slot {
+  pnm_stats s;
+  int depth;                /* nesting of raster passes */
+  uint64_t start;           /* start time of the outermost pass */
+  uint64_t io_start;        /* s.io_ns at the start of the outermost pass */
+  struct stats_slot *prev, *next;
+} stats_slot;
+
+static int stats_on;
+static pnm_stats stats_retired, stats_base;
+#if !defined(_WIN32)
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_slot *stats_slots;
+#else
+static stats_slot stats_single;
+#endif
+
+/* stats_now:
+ * Return a monotonic time in nanoseconds.
+ */
+static uint64_t stats_now(void)
+{
+#if !defined(_WIN32)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+/* stats_add:
+ * Add v to a counter of the calling thread.
+ */
+static void stats_add(uint64_t *c, uint64_t v)
+{
+  STAT_STORE(c, STAT_LOAD(c) + v);
+}
+
+#if !defined(_WIN32)
+/* stats_retire:
+ * Fold the slot of an exiting thread into stats_retired.
+ */
+static void stats_retire(void *arg)
+{
+  stats_slot *t = arg;
+  uint64_t *src = (uint64_t *)&t->s, *dst = (uint64_t *)&stats_retired;
+  size_t k;
+
+  pthread_mutex_lock(&stats_lock);
+  for (k = 0; k < STAT_FIELDS; k++) {
+    dst[k] += src[k];
+  }
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    stats_slots = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  free(t);
+}
+
+/* stats_key_init:
+ * Create the key of the per-thread slots.
+ */
+static void stats_key_init(void)
+{
+  pthread_key_create(&stats_key, stats_retire);
+}
+#endif
+
+/* stats_slot_get:
+ * Return the slot of the calling thread, creating it on first use, or NULL
+ * if statistics are off (or no slot can be allocated).
+ */
+static stats_slot *stats_slot_get(void)
+{
+#if !defined(_WIN32)
+  stats_slot *t;
+#endif
+
+  if (!STAT_LOAD(&stats_on)) {
+    return NULL;
+  }
+#if !defined(_WIN32)
+  pthread_once(&stats_once, stats_key_init);
+  if ((t = pthread_getspecific(stats_key)) == NULL) {
+    if (((t = calloc(1, sizeof(*t))) == NULL) || 
+        (pthread_setspecific(stats_key, t) != 0)) {
+      free(t);
+      return NULL;
+    }
+    pthread_mutex_lock(&stats_lock);
+    t->next = stats_slots;
+    if (stats_slots != NULL) {
+      stats_slots->prev = t;
+    }
+    stats_slots = t;
+    pthread_mutex_unlock(&stats_lock);
+  }
+  return t;
+#else
+  return &stats_single;
+#endif
+}
+
+/* stats_sum:
+ * Sum the counters of all threads into *sum, with stats_lock held.
+ */
+static void stats_sum(pnm_stats *sum)
+{
+  uint64_t *dst = (uint64_t *)sum, *src;
+  size_t k;
+#if !defined(_WIN32)
+  stats_slot *t;
+
+  *sum = stats_retired;
+  for (t = stats_slots; t != NULL; t = t->next) {
+    src = (uint64_t *)&t->s;
+    for (k = 0; k < STAT_FIELDS; k++) {
+      dst[k] += STAT_LOAD(&src[k]);
+    }
+  }
+#else
+  *sum = stats_retired;
+  src = (uint64_t *)&stats_single.s;
+  for (k = 0; k < STAT_FIELDS; k++) {
+    dst[k] += src[k];
+  }
+#endif
+}
+
+/* stats_begin:
+ * Start a raster pass of the calling thread. Returns its slot, or NULL if 
+ * statistics are off. Nested passes are part of the outermost one.
+ */
+static stats_slot *stats_begin(void)
+{
+  stats_slot *t = stats_slot_get();
+
+  if ((t != NULL) && (t->depth++ == 0)) {
+    t->io_start = t->s.io_ns;
+    t->start    = stats_now();
+  }
+  return t;
+}
+
+/* stats_end:
+ * End a raster pass started by stats_begin, which decoded (is_write 0) or 
+ * encoded n samples. Its time less its stdio time is conversion time.
+ */
+static void stats_end(stats_slot *t, int is_write, size_t n)
+{
+  uint64_t ns;
+
+  if ((t == NULL) || (--t->depth > 0)) {
+    return;
+  }
+  ns = stats_now() - t->start - (t->s.io_ns - t->io_start);
+  stats_add(is_write ? &t->s.writes : &t->s.reads, 1);
+  stats_add(&t->s.samples, n);
+  stats_add(&t->s.convert_ns, ns);
+}
+
+/* io_read:
+ * Same as fread, counting the call, its bytes and its time.
+ */
+static size_t io_read(void *p, size_t size, size_t n, FILE *f)
+{
+  stats_slot *t = stats_slot_get();
+  uint64_t start;
+  size_t got;
+
+  if (t == NULL) {
+    return fread(p, size, n, f);
+  }
+  start = stats_now();
+  got   = fread(p, size, n, f);
+  stats_add(&t->s.io_ns, stats_now() - start);
+  stats_add(&t->s.stdio_calls, 1);
+  stats_add(&t->s.bytes_read, got * size);
+  return got;
+}
+
+/* io_write:
+ * Same as fwrite, counting the call, its bytes and its time.
+ */
+static size_t io_write(const void *p, size_t size, size_t n, FILE *f)
+{
+  stats_slot *t = stats_slot_get();
+  uint64_t start;
+  size_t put;
+
+  if (t == NULL) {
+    return fwrite(p, size, n, f);
+  }
+  start = stats_now();
+  put   = fwrite(p, size, n, f);
+  stats_add(&t->s.io_ns, stats_now() - start);
+  stats_add(&t->s.stdio_calls, 1);
+  stats_add(&t->s.bytes_written, put * size);
+  return put;
+}
+
+/* stats_header:
+ * Count a header read or written since start, in ncalls stdio calls of 
+ * nbytes bytes in all.
+ */
+static void stats_header(stats_slot *t, uint64_t start, int is_write,
+  size_t ncalls, size_t nbytes)
+{
+  if (t == NULL) {
+    return;
+  }
+  stats_add(&t->s.header_ns, stats_now() - start);
+  stats_add(&t->s.stdio_calls, ncalls);
+  stats_add(is_write ? &t->s.bytes_written : &t->s.bytes_read, nbytes);
+}
+
+
+/* Header byte source: a block of memory, followed by a stream unless f is 
+ * NULL.
+ */
+typedef struct {
+  FILE *f;
+  const unsigned char *p, *end;
+  int from_file;  /* the last byte came from f */
+  size_t ncalls;  /* getc/ungetc calls on f */
+  size_t nbytes;  /* bytes taken from f */
+} hdr_src;
+
+/* Parsed header fields, shared by all header readers. */
+typedef struct {
+  int   pnm_type;
+  int   xdim, ydim;
+  int   depth;    /* samples per pixel */
+  int   maxval;   /* 1 for PBM, 0 for PFM */
+  float scale;    /* PFM scale factor; its sign gives the endianess */
+  char  tupltype[PNM_TUPLTYPE_LEN]; /* PAM only */
+} hdr_info;
+
+/* hdr_getc:
+ * Return the next header byte or EOF.
+ */
+static int hdr_getc(hdr_src *s)
+{
+  int c;
+
+  s->from_file = (s->p >= s->end);
+  if (!s->from_file) {
+    return *s->p++;
+  }
+  if (s->f == NULL) {
+    return EOF;
+  }
+  s->ncalls++;
+  if ((c = getc(s->f)) != EOF) {
+    s->nbytes++;
+  }
+  return c;
+}
+
+/* hdr_ungetc:
+ * Push back the last byte returned by hdr_getc.
+ */
+static void hdr_ungetc(hdr_src *s, int c)
+{
+  if (s->from_file) {
+    if ((s->f != NULL) && (c != EOF)) {
+      ungetc(c, s->f);
+      s->ncalls++;
+      s->nbytes--;
+    }
+  } else {
+    s->p--;
+  }
+}
+
+/* hdr_skip_comment:
+ * Skip the rest of a comment line, including its newline.
+ */
+static int hdr_skip_comment(hdr_src *s)
+{
+  int c;
+
+  do {
+    c = hdr_getc(s);
+  } while ((c != '\n') && (c != '\r') && (c != EOF));
+  return c;
+}
+
+/* hdr_next:
+ * Skip whitespace and comments; return the first byte of the next token.
+ */
+static int hdr_next(hdr_src *s)
+{
+  int c;
+
+  for (;;) {
+    c = hdr_getc(s);
+    if (c == '#') {
+      if (hdr_skip_comment(s) == EOF) {
+        return EOF;
+      }
+    } else if ((c == EOF) || !isspace(c)) {
+      return c;
+    }
+  }
+}
+
+/* hdr_end_token:
+ * Check the byte that terminates a header token. A single whitespace byte 
+ * (or a comment running up to the end of its line) separates the last header
+ * field from the image data. A CR-LF pair counts as a single line break.
+ */
+static int hdr_end_token(hdr_src *s, int c)
+{
+  if (c == '#') {
+    c = hdr_skip_comment(s);
+  } else if ((c != EOF) && !isspace(c)) {
+    return PNM_ERR_FORMAT;
+  }
+  if ((c == '\r') && ((c = hdr_getc(s)) != '\n') && (c != EOF)) {
+    hdr_ungetc(s, c);
+  }
+  return PNM_OK;
+}
+
+/* hdr_read_int:
+ * Read a non-negative decimal header field.
+ */
+static int hdr_read_int(hdr_src *s, int *val)
+{
+  long v=0;
+  int c = hdr_next(s);
+
+  if ((c == EOF) || !isdigit(c)) {
+    return PNM_ERR_FORMAT;
+  }
+  do {
+    v = 10 * v + (c - '0');
+    if (v > INT_MAX) {
+      return PNM_ERR_RANGE;
+    }
+    c = hdr_getc(s);
+  } while ((c != EOF) && isdigit(c));
+  *val = (int)v;
+  return hdr_end_token(s, c);
+}
+
+/* hdr_read_float:
+ * Read a decimal floating-point header field (PFM scale factor).
+ */
+static int hdr_read_float(hdr_src *s, float *val)
+{
+  char token[64], *endp;
+  int c = hdr_next(s);
+  unsigned int i=0;
+
+  while ((c != EOF) && !isspace(c) && (c != '#')) {
+    if (i == sizeof(token) - 1) {
+      return PNM_ERR_FORMAT;
+    }
+    token[i++] = (char)c;
+    c = hdr_getc(s);
+  }
+  token[i] = '\0';
+  *val = (float)strtod(token, &endp);
+  if ((i == 0) || (*endp != '\0')) {
+    return PNM_ERR_FORMAT;
+  }
+  return hdr_end_token(s, c);
+}
+
+/* hdr_parse_magic:
+ * Read the magic number and decode it to a PNM/PFM type. Returns 
+ * PNM_ERR_UNSUPPORTED for a well-formed magic number of another type (a 'P'
+ * and a letter or digit, followed by whitespace, such as P8), or 
+ * PNM_ERR_FORMAT for anything else.
+ */
+static int hdr_parse_magic(hdr_src *s, int *pnm_type)
+{
+  int c1 = hdr_next(s);
+  int c2 = hdr_getc(s);
+
+  if (c1 != 'P') {
+    return PNM_ERR_FORMAT;
+  }
+  /* NOTE: This part can be written more succinctly, however, 
+   * it is better to have the PNM types decoded explicitly.
+   */
+  switch (c2) {
+    case '1': *pnm_type = PBM_ASCII;     break;
+    case '2': *pnm_type = PGM_ASCII;     break;
+    case '3': *pnm_type = PPM_ASCII;     break;
+    case '4': *pnm_type = PBM_BINARY;    break;
+    case '5': *pnm_type = PGM_BINARY;    break;
+    case '6': *pnm_type = PPM_BINARY;    break;
+    case '7': *pnm_type = PAM;           break;
+    case 'F': *pnm_type = PFM_RGB;       break;
+    case 'f': *pnm_type = PFM_GREYSCALE; break;
+    default:
+      return (isalnum(c2) && isspace(hdr_getc(s))) ? PNM_ERR_UNSUPPORTED : 
+             PNM_ERR_FORMAT;
+  }
+  return PNM_OK;
+}
+
+/* hdr_read_word:
+ * Read a PAM header keyword, leaving the byte that follows it unread.
+ */
+static int hdr_read_word(hdr_src *s, char *word, size_t len)
+{
+  size_t i=0;
+  int c = hdr_next(s);
+
+  while ((c != EOF) && !isspace(c)) {
+    if (i == len - 1) {
+      return PNM_ERR_FORMAT;
+    }
+    word[i++] = (char)c;
+    c = hdr_getc(s);
+  }
+  word[i] = '\0';
+  hdr_ungetc(s, c);
+  return (i > 0) ? PNM_OK : PNM_ERR_FORMAT;
+}
+
+/* hdr_read_line:
+ * Read the rest of a PAM header line, without its leading and trailing 
+ * blanks, appending it to value after a space if value is not empty.
+ */
+static int hdr_read_line(hdr_src *s, char *value, size_t len)
+{
+  size_t i = strlen(value), start = i;
+  int c;
+
+  do {
+    c = hdr_getc(s);
+  } while ((c == ' ') || (c == '\t'));
+  if ((i > 0) && (c != '\n') && (c != '\r') && (c != EOF)) {
+    value[i++] = ' ';
+  }
+  while ((c != '\n') && (c != EOF)) {
+    if (i == len - 1) {
+      return PNM_ERR_FORMAT;
+    }
+    value[i++] = (char)c;
+    c = hdr_getc(s);
+  }
+  while ((i > start) && isspace((unsigned char)value[i-1])) {
+    i--;
+  }
+  value[i] = '\0';
+  return PNM_OK;
+}
+
+/* hdr_parse_pam:
+ * Parse the header lines of a PAM file that follow its magic number, up to
+ * and including the ENDHDR line.
+ * P7
+ * WIDTH <X>
+ * HEIGHT <Y>
+ * DEPTH <samples per tuple>
+ * MAXVAL <levels>
+ * TUPLTYPE <tuple type, e.g. RGB_ALPHA>
+ * ENDHDR
+ */
+static int hdr_parse_pam(hdr_src *s, hdr_info *h)
+{
+  char word[16];
+  int err, c, seen=0;
+
+  h->xdim   = 0;
+  h->ydim   = 0;
+  h->depth  = 0;
+  h->maxval = 0;
+  for (;;) {
+    if ((err = hdr_read_word(s, word, sizeof(word))) != PNM_OK) {
+      return err;
+    }
+    if (strcmp(word, "ENDHDR") == 0) {
+      break;
+    } else if (strcmp(word, "WIDTH") == 0) {
+      err = hdr_read_int(s, &h->xdim);
+      seen |= 1;
+    } else if (strcmp(word, "HEIGHT") == 0) {
+      err = hdr_read_int(s, &h->ydim);
+      seen |= 2;
+    } else if (strcmp(word, "DEPTH") == 0) {
+      err = hdr_read_int(s, &h->depth);
+      seen |= 4;
+    } else if (strcmp(word, "MAXVAL") == 0) {
+      err = hdr_read_int(s, &h->maxval);
+      seen |= 8;
+    } else if (strcmp(word, "TUPLTYPE") == 0) {
+      err = hdr_read_line(s, h->tupltype, sizeof(h->tupltype));
+    } else {
+      err = PNM_ERR_FORMAT;
+    }
+    if (err != PNM_OK) {
+      return err;
+    }
+  }
+  /* The raster starts on the line after ENDHDR. */
+  do {
+    c = hdr_getc(s);
+  } while ((c != '\n') && (c != EOF));
+  if ((seen != 15) || (h->depth < 1)) {
+    return PNM_ERR_FORMAT;
+  }
+  return PNM_OK;
+}
+
+/* image_fits:
+ * Tell whether the raster of a width by height image of depth samples per 
+ * pixel can be addressed in memory: its size in bytes, as int or float 
+ * samples, must be representable as a size_t.
+ */
+static int image_fits(int width, int height, int depth)
+{
+  return (width > 0) && (height > 0) && (depth > 0) &&
+    ((size_t)width <= SIZE_MAX / MAX_SAMPLE_SIZE / (size_t)depth / 
+       (size_t)height);
+}
+
+/* hdr_parse_fields:
+ * Parse a complete PBM/PGM/PPM/PAM/PFM header, leaving the source at the 
+ * first byte of the image data. Returns PNM_OK or a negative error code.
+ */
+static int hdr_parse_fields(hdr_src *s, hdr_info *h)
+{
+  int err;
+
+  h->tupltype[0] = '\0';
+  if ((err = hdr_parse_magic(s, &h->pnm_type)) != PNM_OK) {
+    return err;
+  }
+  if (h->pnm_type == PAM) {
+    h->scale = 0.0;
+    if ((err = hdr_parse_pam(s, h)) != PNM_OK) {
+      return err;
+    }
+  } else {
+    if (((err = hdr_read_int(s, &h->xdim)) != PNM_OK) ||
+        ((err = hdr_read_int(s, &h->ydim)) != PNM_OK)) {
+      return err;
+    }
+    h->depth  = 1;
+    h->maxval = 1;
+    h->scale  = 0.0;
+    switch (h->pnm_type) {
+      case PPM_ASCII: case PPM_BINARY:
+        h->depth = 3;
+        /* Fall through. */
+      case PGM_ASCII: case PGM_BINARY:
+        if ((err = hdr_read_int(s, &h->maxval)) != PNM_OK) {
+          return err;
+        }
+        break;
+      case PFM_RGB:
+        h->depth = 3;
+        /* Fall through. */
+      case PFM_GREYSCALE:
+        h->maxval = 0;
+        if ((err = hdr_read_float(s, &h->scale)) != PNM_OK) {
+          return err;
+        }
+        if (h->scale == 0.0) {
+          return PNM_ERR_FORMAT;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  if ((h->xdim <= 0) || (h->ydim <= 0)) {
+    return PNM_ERR_FORMAT;
+  }
+  if (!image_fits(h->xdim, h->ydim, h->depth)) {
+    return PNM_ERR_RANGE;
+  }
+  if ((h->pnm_type != PFM_RGB) && (h->pnm_type != PFM_GREYSCALE) &&
+      ((h->maxval < 1) || (h->maxval > 65535))) {
+    return PNM_ERR_FORMAT;
+  }
+  return PNM_OK;
+}
+
+/* hdr_parse:
+ * Same as hdr_parse_fields, counting the header in the statistics of the 
+ * calling thread.
+ */
+static int hdr_parse(hdr_src *s, hdr_info *h)
+{
+  stats_slot *t = stats_slot_get();
+  uint64_t start = (t != NULL) ? stats_now() : 0;
+  int err;
+
+  err = hdr_parse_fields(s, h);
+  stats_header(t, start, 0, s->ncalls, s->nbytes);
+  return err;
+}
+
+/* hdr_magic:
+ * Return the magic number string of a PNM/PFM type.
+ */
+static const char *hdr_magic(int pnm_type)
+{
+  static const char *magic[] = { 
+    "P1", "P2", "P3", "P4", "P5", "P6", "P7" 
+  };
+
+  if (pnm_type == PFM_RGB) {
+    return "PF";
+  } else if (pnm_type == PFM_GREYSCALE) {
+    return "Pf";
+  }
+  return magic[pnm_type-1];
+}
+
+/* Header families, as expected by the read_*_header functions. */
+#define  FAMILY_ANY         0
+#define  FAMILY_PBM         1
+#define  FAMILY_PGM         2
+#define  FAMILY_PPM         3
+#define  FAMILY_PFM         4
+#define  FAMILY_PAM         5
+
+/* hdr_family:
+ * Return the header family of a PNM/PFM type.
+ */
+static int hdr_family(int pnm_type)
+{
+  switch (pnm_type) {
+    case PBM_ASCII: case PBM_BINARY: return FAMILY_PBM;
+    case PGM_ASCII: case PGM_BINARY: return FAMILY_PGM;
+    case PPM_ASCII: case PPM_BINARY: return FAMILY_PPM;
+    case PFM_RGB: case PFM_GREYSCALE: return FAMILY_PFM;
+    case PAM:                        return FAMILY_PAM;
+    default: return FAMILY_ANY;
+  }
+}
+
+/* ctx_log:
+ * Format a message and pass it to the log callback of ctx, if any.
+ */
+static void ctx_log(pnm_ctx *ctx, int level, const char *fmt, ...)
+{
+  char msg[LOG_MAXLEN];
+  va_list ap;
+
+  if ((ctx == NULL) || (ctx->log == NULL)) {
+    return;
+  }
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  ctx->log(ctx->log_user, level, msg);
+}
+
+/* ctx_fail:
+ * Record err as the last error of ctx and return it.
+ */
+static int ctx_fail(pnm_ctx *ctx, int err)
+{
+  if (ctx != NULL) {
+    ctx->error = err;
+  }
+  return err;
+}
+
+/* legacy_log:
+ * Log callback of the legacy API: print messages to stderr with the usual
+ * "Info: " and "Error: " prefixes.
+ */
+static void legacy_log(void *user, int level, const char *msg)
+{
+  (void)user;
+  fprintf(stderr, "%s: %s\n", (level == PNM_LOG_ERROR) ? "Error" : "Info", msg);
+}
+
+/* legacy_ctx:
+ * Set up a context for the legacy API, which logs to stderr.
+ */
+static void legacy_ctx(pnm_ctx *ctx)
+{
+  pnm_ctx_init(ctx);
+  pnm_ctx_set_log(ctx, legacy_log, NULL);
+}
 
+/* ctx_parse_header:
+ * Parse the header of f, which must belong to the given family (or any 
+ * family for FAMILY_ANY), and log its contents.
+ */
+static int ctx_parse_header(pnm_ctx *ctx, FILE *f, hdr_info *h, int family)
+{
+  static const char *names[] = { "PNM/PFM", "PBM", "PGM", "PPM", "PFM", "PAM" };
+  hdr_src s = { f, NULL, NULL, 0, 0, 0 };
+  int err;
+
+  if ((err = hdr_parse(&s, h)) != PNM_OK) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Input file not in %s format!", names[family]);
+    return ctx_fail(ctx, err);
+  }
+  if ((family != FAMILY_ANY) && (hdr_family(h->pnm_type) != family)) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Input file not in %s format!", names[family]);
+    return ctx_fail(ctx, PNM_ERR_FORMAT);
+  }
+  switch (hdr_family(h->pnm_type)) {
+    case FAMILY_PBM:
+      ctx_log(ctx, PNM_LOG_INFO, "magic=%s, x_val=%d, y_val=%d",
+        hdr_magic(h->pnm_type), h->xdim, h->ydim);
+      break;
+    case FAMILY_PFM:
+      ctx_log(ctx, PNM_LOG_INFO, "magic=%s, x_val=%d, y_val=%d, aspect_ratio=%f",
+        hdr_magic(h->pnm_type), h->xdim, h->ydim, h->scale);
+      break;
+    case FAMILY_PAM:
+      ctx_log(ctx, PNM_LOG_INFO, 
+        "magic=%s, x_val=%d, y_val=%d, depth=%d, maxcolors_val=%d, tupltype=%s",
+        hdr_magic(h->pnm_type), h->xdim, h->ydim, h->depth, h->maxval, 
+        h->tupltype);
+      break;
+    default:
+      ctx_log(ctx, PNM_LOG_INFO, "magic=%s, x_val=%d, y_val=%d, maxcolors_val=%d",
+        hdr_magic(h->pnm_type), h->xdim, h->ydim, h->maxval);
+      break;
+  }
+  return PNM_OK;
+}
+
+/* pnm_ctx_init:
+ * Set up a silent context.
+ */
+void pnm_ctx_init(pnm_ctx *ctx)
+{
+  ctx->log      = NULL;
+  ctx->log_user = NULL;
+  ctx->error    = PNM_OK;
+}
+
+/* pnm_ctx_set_log:
+ * Route the messages of ctx to log (NULL for silent operation), which is 
+ * passed user along with each message.
+ */
+void pnm_ctx_set_log(pnm_ctx *ctx, pnm_log_fn log, void *user)
+{
+  ctx->log      = log;
+  ctx->log_user = user;
+}
+
+/* pnm_strerror:
+ * Return a description of an error code.
+ */
+const char *pnm_strerror(int err)
+{
+  switch (err) {
+    case PNM_OK:              return "success";
+    case PNM_ERR_IO:          return "I/O error";
+    case PNM_ERR_FORMAT:      return "malformed or truncated file";
+    case PNM_ERR_UNSUPPORTED: return "unsupported format variant";
+    case PNM_ERR_RANGE:       return "value or size out of range";
+    case PNM_ERR_NOMEM:       return "out of memory";
+    default:                  return "unknown error";
+  }
+}
+
+/* pnm_ctx_read_header:
+ * Parse the header of any PNM/PFM file in a single pass, as pnm_read_header
+ * does, logging its contents through ctx.
+ * Returns PNM_OK, PNM_ERR_FORMAT, PNM_ERR_UNSUPPORTED (for an unknown 
+ * magic number such as P8) or PNM_ERR_RANGE.
+ */
+int pnm_ctx_read_header(pnm_ctx *ctx, FILE *f, pnm_info *info)
+{
+  hdr_info h;
+  int err;
+
+  if ((err = ctx_parse_header(ctx, f, &h, FAMILY_ANY)) != PNM_OK) {
+    return err;
+  }
+  info->pnm_type  = h.pnm_type;
+  info->width     = h.xdim;
+  info->height    = h.ydim;
+  info->depth     = h.depth;
+  info->maxval    = h.maxval;
+  info->endianess = 0;
+  if (h.pnm_type == PFM_RGB || h.pnm_type == PFM_GREYSCALE) {
+    info->endianess = (h.scale > 0.0) ? 1 : -1;
+  }
+  strcpy(info->tupltype, h.tupltype);
+  return PNM_OK;
+}
 
 /* get_pnm_type:
  * Read the header contents of a PBM/PGM/PPM/PFM file up to the point of 
@@ -52,592 +909,3532 @@
 int get_pnm_type(FILE *f)
 {
   int pnm_type=0;
-  unsigned int i;
-  char magic[MAXLINE];
-  char line[MAXLINE];
- 
-  /* Read the PNM/PFM file header. */
-  while (fgets(line, MAXLINE, f) != NULL) {
-    int flag = 0;
-    for (i = 0; i < strlen(line); i++) {
-      if (isgraph(line[i])) {
-        if ((line[i] == '#') && (flag == 0)) {
-          flag = 1;
-        }
+  hdr_src s = { f, NULL, NULL, 0, 0, 0 };
+  pnm_ctx ctx;
+
+  legacy_ctx(&ctx);
+  if (hdr_parse_magic(&s, &pnm_type) != PNM_OK) {
+    ctx_log(&ctx, PNM_LOG_ERROR, "Unknown PNM/PFM file; wrong magic number!");
+    exit(1);
+  }
+
+  return (pnm_type);
+}
+
+/* read_pbm_header:
+ * Read the header contents of a PBM (Portable Binary Map) file.
+ * Returns the number of bytes that need be allocated for the image data.
+ * An ASCII PBM image file follows the format:
+ * P1
+ * <X> <Y>
+ * <I1> <I2> ... <IMAX>
+ * A binary PBM image file uses P4 instead of P1 and 
+ * the data values are represented in binary. 
+ * NOTE1: Comment lines start with '#'.
+ * NOTE2: < > denote integer values (in decimal).
+ */
+size_t read_pbm_header(FILE *f, int *img_xdim, int *img_ydim, int *is_ascii)
+{
+  hdr_info h;
+  pnm_ctx ctx;
+
+  /* Read the PBM file header. */
+  legacy_ctx(&ctx);
+  if (ctx_parse_header(&ctx, f, &h, FAMILY_PBM) != PNM_OK) {
+    exit(1);
+  }
+  *is_ascii = (h.pnm_type == PBM_ASCII) ? 1 : 0;
+  *img_xdim   = h.xdim;
+  *img_ydim   = h.ydim;
+
+  return (size_t)h.xdim * h.ydim * sizeof(int);
+}
+
+/* read_pgm_header:
+ * Read the header contents of a PGM (Portable Grey[scale] Map) file.
+ * Returns the number of bytes that need be allocated for the image data.
+ * An ASCII PGM image file follows the format:
+ * P2
+ * <X> <Y> 
+ * <levels>
+ * <I1> <I2> ... <IMAX>
+ * A binary PGM image file uses P5 instead of P2 and 
+ * the data values are represented in binary. 
+ * NOTE1: Comment lines start with '#'.
+ * NOTE2: < > denote integer values (in decimal).
+ */
+size_t read_pgm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors, int *is_ascii)
+{
+  hdr_info h;
+  pnm_ctx ctx;
+
+  /* Read the PGM file header. */
+  legacy_ctx(&ctx);
+  if (ctx_parse_header(&ctx, f, &h, FAMILY_PGM) != PNM_OK) {
+    exit(1);
+  }
+  *is_ascii = (h.pnm_type == PGM_ASCII) ? 1 : 0;
+  *img_xdim   = h.xdim;
+  *img_ydim   = h.ydim;
+  *img_colors = h.maxval;
+
+  return (size_t)h.xdim * h.ydim * sizeof(int);
+}
+
+/* read_ppm_header:
+ * Read the header contents of a PPM (Portable Pix[el] Map) file.
+ * Returns the number of bytes that need be allocated for the image data.
+ * An ASCII PPM image file follows the format:
+ * P3
+ * <X> <Y> 
+ * <colors>
+ * <R1> <G1> <B1> ... <RMAX> <GMAX> <BMAX>
+ * A binary PPM image file uses P6 instead of P3 and 
+ * the data values are represented in binary. 
+ * NOTE1: Comment lines start with '#'.
+ # NOTE2: < > denote integer values (in decimal).
+ */
+size_t read_ppm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors, int *is_ascii)
+{
+  hdr_info h;
+  pnm_ctx ctx;
+
+  /* Read the PPM file header. */
+  legacy_ctx(&ctx);
+  if (ctx_parse_header(&ctx, f, &h, FAMILY_PPM) != PNM_OK) {
+    exit(1);
+  }
+  *is_ascii = (h.pnm_type == PPM_ASCII) ? 1 : 0;
+  *img_xdim   = h.xdim;
+  *img_ydim   = h.ydim;
+  *img_colors = h.maxval;
+
+  return 3 * (size_t)h.xdim * h.ydim * sizeof(int);
+}
+
+/* read_pfm_header:
+ * Read the header contents of a PFM (portable float map) file.
+ * Returns the number of bytes that need be allocated for the image data.
+ * A PFM image file follows the format:
+ * [PF|Pf]
+ * <X> <Y> 
+ * (endianess)
+ * {R1}{G1}{B1} ... {RMAX}{GMAX}{BMAX} 
+ * NOTE1: Comment lines, if allowed, start with '#'.
+ # NOTE2: < > denote integer values (in decimal).
+ # NOTE3: ( ) denote floating-point values (in decimal).
+ # NOTE4: { } denote floating-point values (coded in binary).
+ */
+size_t read_pfm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_type, int *endianess)
+{
+  hdr_info h;
+  pnm_ctx ctx;
+
+  /* Read the PFM file header. */
+  legacy_ctx(&ctx);
+  if (ctx_parse_header(&ctx, f, &h, FAMILY_PFM) != PNM_OK) {
+    exit(1);
+  }
+
+  /* FIXME: Aspect ratio different to 1.0 is not yet supported. */
+  if (!floatEqualComparison(h.scale, -1.0, 1E-06) &&
+      !floatEqualComparison(h.scale, 1.0, 1E-06)) {
+    ctx_log(&ctx, PNM_LOG_ERROR, "Aspect ratio different to -1.0 or +1.0 is unsupported!");
+    exit(1);
+  }
+
+  *img_xdim   = h.xdim;
+  *img_ydim   = h.ydim;
+  *img_type   = (h.pnm_type == PFM_RGB) ? RGB_TYPE : GREYSCALE_TYPE;
+  if (h.scale > 0.0) {
+    *endianess = 1;
+  } else {
+    *endianess = -1;
+  }
+
+  return (size_t)h.depth * h.xdim * h.ydim * sizeof(float);
+}
+
+/* read_pam_header:
+ * Read the header contents of a PAM (portable arbitrary map) file into the
+ * image dimensions, the number of samples per tuple (depth), the maxval and
+ * the tuple type, if any (tupltype must hold PNM_TUPLTYPE_LEN bytes).
+ * Returns the number of bytes that need be allocated for the image data.
+ * A PAM image file follows the format:
+ * P7
+ * WIDTH <X>
+ * HEIGHT <Y>
+ * DEPTH <samples per tuple>
+ * MAXVAL <levels>
+ * TUPLTYPE <tuple type>
+ * ENDHDR
+ * {T1} ... {TMAX}
+ * NOTE1: Comment lines start with '#'; TUPLTYPE is optional.
+ * NOTE2: { } denote tuples of DEPTH samples (coded in binary).
+ */
+size_t read_pam_header(FILE *f, int *img_xdim, int *img_ydim, int *img_depth,
+  int *img_colors, char *tupltype)
+{
+  hdr_info h;
+  pnm_ctx ctx;
+
+  /* Read the PAM file header. */
+  legacy_ctx(&ctx);
+  if (ctx_parse_header(&ctx, f, &h, FAMILY_PAM) != PNM_OK) {
+    exit(1);
+  }
+  *img_xdim   = h.xdim;
+  *img_ydim   = h.ydim;
+  *img_depth  = h.depth;
+  *img_colors = h.maxval;
+  if (tupltype != NULL) {
+    strcpy(tupltype, h.tupltype);
+  }
+
+  return (size_t)h.depth * h.xdim * h.ydim * sizeof(int);
+}
+
+/* pnm_read_header:
+ * Detect the type of a PNM/PFM file and parse its header in a single pass,
+ * without rewinding, so that pipes and other unseekable streams can be 
+ * read. The stream is left at the first byte of the raster.
+ * Returns PNM_OK, PNM_ERR_FORMAT, PNM_ERR_UNSUPPORTED, or PNM_ERR_RANGE if 
+ * the size of the raster does not fit a size_t.
+ */
+int pnm_read_header(FILE *f, pnm_info *info)
+{
+  return pnm_ctx_read_header(NULL, f, info);
+}
+
+/* store_sample:
+ * Store a decoded sample value at index i of a buffer of the given type.
+ */
+static void store_sample(void *img_in, int sample_type, size_t i, int val)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:
+      ((uint8_t *)img_in)[i] = (uint8_t)val;
+      break;
+    case PNM_SAMPLE_U16:
+      ((uint16_t *)img_in)[i] = (uint16_t)val;
+      break;
+    default:
+      ((int *)img_in)[i] = val;
+      break;
+  }
+}
+
+/* convert_samples:
+ * Convert n binary samples of bps bytes each from src into img_in, starting 
+ * at index i. Only int buffers take 16-bit samples here; 16-bit buffers are
+ * filled in place by read_binary_samples.
+ */
+static void convert_samples(void *img_in, int sample_type, size_t i,
+  const unsigned char *src, int bps, size_t n)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:
+      memcpy((uint8_t *)img_in + i, src, n);
+      break;
+    case PNM_SAMPLE_U16:
+      pnm_simd_widen_u8_u16((uint16_t *)img_in + i, src, n);
+      break;
+    default:
+      if (bps == 2) {
+        pnm_simd_be16_int((int *)img_in + i, src, n);
+      } else {
+        pnm_simd_widen_u8_int((int *)img_in + i, src, n);
+      }
+      break;
+  }
+}
+
+/* read_binary_samples:
+ * Read up to n binary samples of bps bytes each (big-endian when bps is 2) 
+ * in large blocks, converting them to sample_type. Pass SIZE_MAX as n in 
+ * order to read up to EOF. Returns the number of samples read.
+ */
+static size_t read_binary_samples(FILE *f, void *img_in, int sample_type,
+  int bps, size_t n)
+{
+  unsigned char buf[IOBUF_SIZE];
+  stats_slot *t = stats_begin();
+  size_t i=0, m, got;
+
+  /* Samples of the same width as the buffer are read in place. */
+  if ((sample_type == PNM_SAMPLE_U8) && (bps == 1)) {
+    i = io_read(img_in, 1, n, f);
+  } else if ((sample_type == PNM_SAMPLE_U16) && (bps == 2)) {
+    i = io_read(img_in, 2, n, f);
+    if (IS_LITTLE_ENDIAN) {
+      pnm_simd_bswap16((uint16_t *)img_in, (const uint16_t *)img_in, i);
+    }
+  } else {
+    while (i < n) {
+      m = (n - i < (size_t)(IOBUF_SIZE / bps)) ? n - i : (size_t)(IOBUF_SIZE / bps);
+      if ((got = io_read(buf, bps, m, f)) == 0) {
+        break;
+      }
+      convert_samples(img_in, sample_type, i, buf, bps, got);
+      i += got;
+    }
+  }
+  stats_end(t, 0, i);
+  return i;
+}
+
+/* Buffered reader for ASCII (P1/P2/P3) payloads. */
+typedef struct {
+  FILE *f;
+  unsigned char *buf;
+  size_t pos, len;
+  int eof;
+} ascii_in;
+
+/* ascii_open:
+ * Set up a buffered ASCII payload reader on f.
+ */
+static int ascii_open(ascii_in *in, FILE *f)
+{
+  in->f   = f;
+  in->pos = 0;
+  in->len = 0;
+  in->eof = 0;
+  in->buf = calloc(ASCIIBUF_SIZE + 8, 1);
+  return (in->buf != NULL) ? PNM_OK : PNM_ERR_NOMEM;
+}
+
+/* ascii_close:
+ * Release an ASCII payload reader. Bytes read ahead of the last token are 
+ * given back to seekable streams.
+ */
+static void ascii_close(ascii_in *in)
+{
+  if (in->len > in->pos) {
+    fseek(in->f, -(long)(in->len - in->pos), SEEK_CUR);
+  }
+  free(in->buf);
+  in->buf = NULL;
+}
+
+/* ascii_fill:
+ * Move the unread bytes to the start of the buffer and refill the rest of it.
+ * The buffered bytes are always followed by a NUL sentinel.
+ * Returns the number of bytes available.
+ */
+static size_t ascii_fill(ascii_in *in)
+{
+  size_t got;
+
+  if (in->pos > 0) {
+    memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos  = 0;
+  }
+  if (!in->eof) {
+    got = io_read(in->buf + in->len, 1, ASCIIBUF_SIZE - in->len, in->f);
+    if (got < ASCIIBUF_SIZE - in->len) {
+      in->eof = 1;
+    }
+    in->len += got;
+  }
+  in->buf[in->len] = '\0';
+  return in->len;
+}
+
+/* ascii_skip:
+ * Skip whitespace and comments. Returns the first byte of the next token, 
+ * which is left unread, or EOF.
+ */
+static int ascii_skip(ascii_in *in)
+{
+  const unsigned char *p, *end;
+
+  for (;;) {
+    p   = in->buf + in->pos;
+    end = in->buf + in->len;
+    p   = pnm_simd_skip_space(p, end);
+    in->pos = p - in->buf;
+    if (p == end) {
+      if (ascii_fill(in) == 0) {
+        return EOF;
+      }
+    } else if (*p == '#') {
+      /* Skip the comment, which may continue in the next blocks. */
+      while ((p = memchr(in->buf + in->pos, '\n', in->len - in->pos)) == NULL) {
+        in->pos = in->len;
+        if (ascii_fill(in) == 0) {
+          return EOF;
+        }
+      }
+      in->pos = p - in->buf;
+    } else {
+      return *p;
+    }
+  }
+}
+
+/* ascii_next_int:
+ * Parse the next decimal token. Returns 1 on success, or 0 at EOF or at a 
+ * token that is not a number.
+ */
+static int ascii_next_int(ascii_in *in, int *val)
+{
+  const unsigned char *p, *end;
+  unsigned int v=0, d;
+  int neg=0, ndigits=0;
+
+  if (ascii_skip(in) == EOF) {
+    return 0;
+  }
+  /* Make sure that typical tokens do not span two blocks. */
+  if ((in->len - in->pos < ASCII_MAXTOKEN) && !in->eof) {
+    ascii_fill(in);
+  }
+  p   = in->buf + in->pos;
+  end = in->buf + in->len;
+  if ((*p == '-') || (*p == '+')) {
+    neg = (*p++ == '-');
+  }
+  for (;;) {
+    while ((p < end) && ((d = (unsigned int)(*p - '0')) < 10)) {
+      v = (v <= (unsigned int)INT_MAX / 10) ? 10 * v + d : UINT_MAX;
+      p++;
+      ndigits++;
+    }
+    in->pos = p - in->buf;
+    if ((p < end) || in->eof || (ascii_fill(in) == 0)) {
+      break;
+    }
+    p   = in->buf + in->pos;
+    end = in->buf + in->len;
+  }
+  if (ndigits == 0) {
+    return 0;
+  }
+  if (v > INT_MAX) {
+    v = INT_MAX;
+  }
+  *val = neg ? -(int)v : (int)v;
+  return 1;
+}
+
+/* swar_digits:
+ * Classify the four bytes at p as digits or not, eight bits per byte, and 
+ * return the decimal value of the leading digits (up to four) in *val.
+ * Returns the number of leading digits; 4 means that more may follow.
+ * NOTE: Little-endian hosts only.
+ */
+static int swar_digits(const unsigned char *p, unsigned int *val)
+{
+  uint32_t w, m, d;
+  int len=0;
+
+  memcpy(&w, p, sizeof(w));
+  m = ((w & 0xF0F0F0F0u) ^ 0x30303030u) |
+      (((w + 0x06060606u) & 0xF0F0F0F0u) ^ 0x30303030u);
+  if (m == 0) {
+    len = 4;
+  } else {
+#if defined(__GNUC__)
+    len = __builtin_ctz(m) >> 3;
+#else
+    while ((m & 0xFF) == 0) {
+      m >>= 8;
+      len++;
+    }
+#endif
+    if (len == 0) {
+      return 0;
+    }
+  }
+  /* Right-align the digits and combine them pairwise. */
+  d = (w - 0x30303030u) << (8 * (4 - len));
+  d = ((d & 0x000F000Fu) * 10) + ((d >> 8) & 0x000F000Fu);
+  *val = (d & 0xFFFFu) * 100 + (d >> 16);
+  return len;
+}
+
+/* ascii_parse_block:
+ * Parse unsigned decimal tokens straight from the buffered block for as long
+ * as each of them is certain to end inside the block. Signs, comments and 
+ * tokens near the end of the block are left to ascii_next_int.
+ * Returns the updated sample count i.
+ */
+static size_t ascii_parse_block(ascii_in *in, void *img_in, int sample_type,
+  size_t i, size_t n)
+{
+  const unsigned char *p    = in->buf + in->pos;
+  const unsigned char *end  = in->buf + in->len;
+  const unsigned char *safe = end;
+  const unsigned char *q;
+  unsigned int d, v4;
+  uint64_t v;
+  int len;
+
+  if (!in->eof) {
+    safe = (in->len > ASCII_MAXTOKEN) ? end - ASCII_MAXTOKEN : in->buf;
+  }
+  while ((i < n) && (p < safe)) {
+    if (IS_SPACE(*p)) {
+      p++;
+      if (IS_SPACE(*p)) {
+        p = pnm_simd_skip_space(p, end);
+      }
+      continue;
+    }
+    q = p;
+    if (IS_LITTLE_ENDIAN) {
+      /* Tokens of up to three digits are decoded without branching on each 
+       * digit; the buffer has slack past its end for the 4-byte loads.
+       */
+      if ((len = swar_digits(p, &v4)) == 0) {
+        break;
+      }
+      v  = v4;
+      p += len;
+    } else {
+      if ((d = (unsigned int)(*p - '0')) >= 10) {
+        break;
+      }
+      v = d;
+      p++;
+    }
+    /* The buffer is NUL-terminated, so no bounds check is needed here. */
+    while ((d = (unsigned int)(*p - '0')) < 10) {
+      v = 10 * v + d;
+      p++;
+    }
+    if ((p == end) && !in->eof) {
+      p = q;
+      break;
+    }
+    if ((p - q > 18) || (v > INT_MAX)) {
+      v = INT_MAX;
+    }
+    if (sample_type == PNM_SAMPLE_INT) {
+      ((int *)img_in)[i++] = (int)v;
+    } else {
+      store_sample(img_in, sample_type, i++, (int)v);
+    }
+    /* Consume the separator that usually follows. */
+    if (*p == ' ') {
+      p++;
+    }
+  }
+  in->pos = p - in->buf;
+  return i;
+}
+
+/* ascii_read_samples:
+ * Read up to n ASCII decimal samples from in, storing them as sample_type.
+ * Returns the number of samples read.
+ */
+static size_t ascii_read_samples(ascii_in *in, void *img_in, int sample_type,
+  size_t n)
+{
+  size_t i=0;
+  int val;
+
+  while (i < n) {
+    i = ascii_parse_block(in, img_in, sample_type, i, n);
+    if (i == n) {
+      break;
+    }
+    /* Block boundaries, comments and signed values. */
+    if (!ascii_next_int(in, &val)) {
+      break;
+    }
+    store_sample(img_in, sample_type, i++, val);
+  }
+  return i;
+}
+
+/* ascii_read_bits:
+ * Read up to n ASCII PBM pixels from in, which need not be separated by 
+ * whitespace. Returns the number of samples read.
+ */
+static size_t ascii_read_bits(ascii_in *in, void *img_in, int sample_type,
+  size_t n)
+{
+  size_t i;
+  int c;
+
+  for (i = 0; i < n; i++) {
+    c = ascii_skip(in);
+    if ((c != '0') && (c != '1')) {
+      break;
+    }
+    store_sample(img_in, sample_type, i, c - '0');
+    in->pos++;
+  }
+  return i;
+}
+
+/* read_ascii_samples:
+ * Read up to n ASCII decimal samples, storing them as sample_type. Pass 
+ * SIZE_MAX as n in order to read up to EOF.
+ * Returns the number of samples read.
+ */
+static size_t read_ascii_samples(FILE *f, void *img_in, int sample_type,
+  size_t n)
+{
+  stats_slot *t = stats_begin();
+  ascii_in in;
+  size_t i=0;
+
+  if (ascii_open(&in, f) == PNM_OK) {
+    i = ascii_read_samples(&in, img_in, sample_type, n);
+    ascii_close(&in);
+  }
+  stats_end(t, 0, i);
+  return i;
+}
+
+/* read_ascii_bits:
+ * Read up to n ASCII PBM pixels, which need not be separated by whitespace.
+ * Pass SIZE_MAX as n in order to read up to EOF.
+ * Returns the number of samples read.
+ */
+static size_t read_ascii_bits(FILE *f, void *img_in, int sample_type,
+  size_t n)
+{
+  stats_slot *t = stats_begin();
+  ascii_in in;
+  size_t i=0;
+
+  if (ascii_open(&in, f) == PNM_OK) {
+    i = ascii_read_bits(&in, img_in, sample_type, n);
+    ascii_close(&in);
+  }
+  stats_end(t, 0, i);
+  return i;
+}
+
+/* read_pbm_samples:
+ * Read the x_size by y_size raster of a PBM file, one sample per pixel.
+ * ASCII pixels need not be separated by whitespace; binary rows are packed 
+ * 8 pixels per byte, MSB first, and padded to a byte boundary. Binary rows 
+ * are read in blocks of whole rows.
+ * Returns the number of samples read.
+ */
+static size_t read_pbm_samples(FILE *f, void *img_in, int sample_type,
+  int x_size, int y_size, int is_ascii)
+{
+  size_t i=0, n = (size_t)x_size * y_size;
+  size_t row_bytes = ((size_t)x_size + 7) / 8;
+  size_t nrows, got, r;
+  unsigned char *buf;
+  stats_slot *t;
+  int y;
+
+  if (is_ascii == 1) {
+    return read_ascii_bits(f, img_in, sample_type, n);
+  }
+
+  nrows = (row_bytes < IOBUF_SIZE) ? IOBUF_SIZE / row_bytes : 1;
+  if ((buf = malloc(nrows * row_bytes)) == NULL) {
+    return 0;
+  }
+  t = stats_begin();
+  for (y = 0; y < y_size; y += (int)got) {
+    if ((size_t)(y_size - y) < nrows) {
+      nrows = y_size - y;
+    }
+    got = io_read(buf, row_bytes, nrows, f);
+    for (r = 0; r < got; r++, i += x_size) {
+      if (sample_type == PNM_SAMPLE_U8) {
+        pnm_simd_unpack_bits_u8((uint8_t *)img_in + i, buf + r*row_bytes, x_size);
+      } else {
+        pnm_simd_unpack_bits_int((int *)img_in + i, buf + r*row_bytes, x_size);
       }
     }
-    if (flag == 0) {
-      sscanf(line, "%2s", magic);
+    if (got < nrows) {
       break;
     }
   }
+  stats_end(t, 0, i);
+  free(buf);
+  return i;
+}
+
+/* read_float_samples:
+ * Read up to n PFM floats in large blocks straight into img_in, swapping 
+ * their bytes in place if swap is set. Pass SIZE_MAX as n in order to read 
+ * up to EOF. Returns the number of floats read.
+ */
+static size_t read_float_samples(FILE *f, float *img_in, size_t n, int swap)
+{
+  stats_slot *t = stats_begin();
+  size_t i=0, m, got;
+
+  while (i < n) {
+    m = (n - i < IOBUF_SIZE / sizeof(float)) ? n - i : IOBUF_SIZE / sizeof(float);
+    if ((got = io_read(img_in + i, sizeof(float), m, f)) == 0) {
+      break;
+    }
+    if (swap) {
+      pnm_simd_bswap32(img_in + i, img_in + i, got);
+    }
+    i += got;
+  }
+  stats_end(t, 0, i);
+  return i;
+}
+
+/* check_u8_colors:
+ * Refuse maxval values that do not fit 8-bit sample buffers.
+ */
+static void check_u8_colors(int img_colors)
+{
+  if (img_colors > 255) {
+    fprintf(stderr, "Error: maxval %d does not fit 8-bit samples!\n", img_colors);
+    exit(1);
+  }
+}
+
+/* read_pbm_data:
+ * Read the data contents of a PBM (portable bit map) file.
+ */
+void read_pbm_data(FILE *f, int *img_in, int is_ascii)
+{
+  unsigned char buf[IOBUF_SIZE];
+  stats_slot *t;
+  size_t i=0, got;
+
+  if (is_ascii == 1) {
+    read_ascii_bits(f, img_in, PNM_SAMPLE_INT, SIZE_MAX);
+    return;
+  }
+
+  /* Read the rest of the PBM file and decode it 8 pixels per byte. */
+  t = stats_begin();
+  while ((got = io_read(buf, 1, IOBUF_SIZE, f)) > 0) {
+    pnm_simd_unpack_bits_int(img_in + i, buf, 8 * got);
+    i += 8 * got;
+  }
+  stats_end(t, 0, i);
+}
+
+/* read_pgm_data:
+ * Read the data contents of a PGM (portable grey map) file.
+ */
+void read_pgm_data(FILE *f, int *img_in, int is_ascii)
+{
+  /* Read the rest of the PGM file. */
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_INT, SIZE_MAX);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_INT, 1, SIZE_MAX);
+  }
+}
+
+/* read_ppm_data:
+ * Read the data contents of a PPM (portable pix map) file.
+ */
+void read_ppm_data(FILE *f, int *img_in, int is_ascii)
+{
+  /* Read the rest of the PPM file; the R, G, B interleaving of the file is 
+   * the same as the one of img_in.
+   */
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_INT, SIZE_MAX);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_INT, 1, SIZE_MAX);
+  }
+}
+
+/* read_pbm_data_ex:
+ * Read the data contents of a PBM file with the image dimensions known from 
+ * its header. Exactly img_xdim * img_ydim pixels are read, skipping the 
+ * padding bits at the end of each binary row.
+ */
+void read_pbm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int is_ascii)
+{
+  read_pbm_samples(f, img_in, PNM_SAMPLE_INT, img_xdim, img_ydim, is_ascii);
+}
+
+/* read_pgm_data_ex:
+ * Read the data contents of a PGM file with the image dimensions and the 
+ * maxval known from its header. Exactly img_xdim * img_ydim samples are 
+ * read; binary samples take two bytes (big-endian) when img_colors exceeds 
+ * 255.
+ */
+void read_pgm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = (size_t)img_xdim * img_ydim;
+
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_INT, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_INT, 
+      (img_colors > 255) ? 2 : 1, n);
+  }
+}
+
+/* read_ppm_data_ex:
+ * Read the data contents of a PPM file with the image dimensions and the 
+ * maxval known from its header. Exactly 3 * img_xdim * img_ydim samples are 
+ * read; binary samples take two bytes (big-endian) when img_colors exceeds 
+ * 255.
+ */
+void read_ppm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = 3 * (size_t)img_xdim * img_ydim;
+
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_INT, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_INT, 
+      (img_colors > 255) ? 2 : 1, n);
+  }
+}
+
+/* read_pfm_data:
+ * Read the data contents of a PFM (portable float map) file, whose floats 
+ * are big-endian if endianess is 1 and little-endian otherwise, into host 
+ * byte order.
+ */
+void read_pfm_data(FILE *f, float *img_in, int img_type, int endianess)
+{
+  int swap = ((endianess == 1) == IS_LITTLE_ENDIAN);
+
+  if ((img_type != RGB_TYPE) && (img_type != GREYSCALE_TYPE)) {
+    return;
+  }
+  /* Read the rest of the PFM file. */
+  read_float_samples(f, img_in, SIZE_MAX, swap);
+}
+
+/* read_pam_data:
+ * Read the data contents of a PAM file with the image dimensions, depth and
+ * maxval known from its header. Exactly img_depth * img_xdim * img_ydim 
+ * samples are read; they take two bytes (big-endian) when img_colors 
+ * exceeds 255.
+ */
+void read_pam_data(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int img_depth, int img_colors)
+{
+  read_binary_samples(f, img_in, PNM_SAMPLE_INT, (img_colors > 255) ? 2 : 1, 
+    (size_t)img_depth * img_xdim * img_ydim);
+}
+
+/* Multi-threaded ASCII decode. */
+
+#if !defined(_WIN32)
+/* One chunk of an ASCII payload block, decoded by one thread. */
+typedef struct {
+  const unsigned char *p, *end; /* the chunk; it ends at whitespace */
+  void *img_in;
+  int sample_type;
+  int bits;                     /* PBM: every '0'/'1' byte is a pixel */
+  size_t first;                 /* index of the first sample of the chunk */
+  size_t count;                 /* number of samples in the chunk */
+  int irregular;                /* comments, signs or other stray bytes */
+} ascii_chunk;
+
+/* pnm_threads:
+ * Resolve a thread-count parameter; values of 0 or less stand for the 
+ * number of online processors.
+ */
+static int pnm_threads(int nthreads)
+{
+  long n = nthreads;
+
+  if (n <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (n < 1) {
+    n = 1;
+  } else if (n > PNM_MAX_THREADS) {
+    n = PNM_MAX_THREADS;
+  }
+  return (int)n;
+}
+
+/* run_jobs:
+ * Run fn on each of the njobs jobs (of job_size bytes each) in its own 
+ * thread, the first one in the calling thread, and wait for all of them. 
+ * Jobs whose thread cannot be created run in the calling thread.
+ */
+static void run_jobs(void *(*fn)(void *), void *jobs, size_t job_size,
+  int njobs)
+{
+  pthread_t tid[PNM_MAX_THREADS];
+  int started[PNM_MAX_THREADS];
+  int t;
+
+  if (njobs < 1) {
+    return;
+  }
+  for (t = 1; t < njobs; t++) {
+    started[t] = (pthread_create(&tid[t], NULL, fn, 
+      (char *)jobs + t * job_size) == 0);
+    if (!started[t]) {
+      fn((char *)jobs + t * job_size);
+    }
+  }
+  fn(jobs);
+  for (t = 1; t < njobs; t++) {
+    if (started[t]) {
+      pthread_join(tid[t], NULL);
+    }
+  }
+}
+
+/* count_chunk:
+ * Count the tokens of a chunk, flagging any byte other than a digit or 
+ * whitespace.
+ */
+static void *count_chunk(void *arg)
+{
+  ascii_chunk *c = arg;
+
+  c->count = pnm_simd_count_tokens(c->p, c->end, c->bits, &c->irregular);
+  return NULL;
+}
+
+/* parse_chunk:
+ * Parse the tokens of a chunk, which has passed count_chunk, into the 
+ * samples starting at index first.
+ */
+static void *parse_chunk(void *arg)
+{
+  ascii_chunk *c = arg;
+  const unsigned char *p = c->p, *q;
+  size_t i = c->first;
+  unsigned int d;
+  uint64_t v;
+
+  for (;;) {
+    p = pnm_simd_skip_space(p, c->end);
+    if (p == c->end) {
+      break;
+    }
+    if (c->bits) {
+      store_sample(c->img_in, c->sample_type, i++, *p++ - '0');
+      continue;
+    }
+    /* The chunk ends at whitespace, so each token ends inside it. */
+    q = p;
+    v = 0;
+    while ((d = (unsigned int)(*p - '0')) < 10) {
+      v = 10 * v + d;
+      p++;
+    }
+    if ((p - q > 18) || (v > INT_MAX)) {
+      v = INT_MAX;
+    }
+    if (c->sample_type == PNM_SAMPLE_INT) {
+      ((int *)c->img_in)[i++] = (int)v;
+    } else {
+      store_sample(c->img_in, c->sample_type, i++, (int)v);
+    }
+  }
+  return NULL;
+}
+
+/* block_cut:
+ * Return the length of the part of a block that ends with its last newline,
+ * or else with its last whitespace byte, so that neither a token nor a 
+ * comment continues past it. Returns 0 if the block has no whitespace.
+ */
+static size_t block_cut(const unsigned char *buf, size_t len)
+{
+  const unsigned char *p;
+  size_t cut = len;
+
+  for (p = buf + len; p > buf; p--) {
+    if (p[-1] == '\n') {
+      return p - buf;
+    }
+  }
+  while ((cut > 0) && !IS_SPACE(buf[cut - 1])) {
+    cut--;
+  }
+  return cut;
+}
+
+/* read_ascii_mt:
+ * Read up to n ASCII samples (PBM pixels if bits is set) with up to nthreads
+ * threads. The payload is read in blocks of ASCII_MT_BLOCK bytes, which are 
+ * cut at their last newline and split into one chunk per thread at 
+ * whitespace. Each thread counts the tokens of its chunk, a prefix sum over 
+ * the counts gives the index of the first sample of each chunk, and the 
+ * threads then parse their chunks in place. From the first chunk with 
+ * comments, signs or other irregular bytes, or the one that ends the raster,
+ * the rest of the block goes through the sequential reader, so the result is
+ * always the same as its own.
+ * Returns the number of samples read.
+ */
+static size_t read_ascii_mt(FILE *f, void *img_in, int sample_type, size_t n,
+  int bits, int nthreads)
+{
+  ascii_chunk chunk[PNM_MAX_THREADS];
+  ascii_in in;
+  unsigned char *buf, saved;
+  size_t i=0, len=0, cut=0, got, total, s;
+  size_t size = pnm_sample_size(sample_type);
+  stats_slot *st;
+  int eof=0, nchunks, t;
+
+  if ((buf = malloc(ASCII_MT_BLOCK + 8)) == NULL) {
+    return 0;
+  }
+  st = stats_begin();
+  while (i < n) {
+    if (!eof) {
+      got  = io_read(buf + len, 1, ASCII_MT_BLOCK - len, f);
+      eof  = (got < ASCII_MT_BLOCK - len);
+      len += got;
+      buf[len] = '\0';
+    }
+    if (len == 0) {
+      break;
+    }
+    cut = eof ? len : block_cut(buf, len);
+    if (cut == 0) {
+      /* A token as long as the block; let the sequential reader stop. */
+      cut = len;
+    }
+
+    /* Count the tokens of each chunk. */
+    nchunks = nthreads;
+    if ((size_t)nchunks > cut / IOBUF_SIZE + 1) {
+      nchunks = (int)(cut / IOBUF_SIZE + 1);
+    }
+    for (t = 0, s = 0; t < nchunks; t++) {
+      chunk[t].p = buf + s;
+      s = (t == nchunks - 1) ? cut : cut / nchunks * (t + 1);
+      if (s < (size_t)(chunk[t].p - buf)) {
+        s = chunk[t].p - buf;
+      }
+      while ((s < cut) && !IS_SPACE(buf[s])) {
+        s++;
+      }
+      chunk[t].end         = buf + s;
+      chunk[t].img_in      = img_in;
+      chunk[t].sample_type = sample_type;
+      chunk[t].bits        = bits;
+    }
+    run_jobs(count_chunk, chunk, sizeof(ascii_chunk), nchunks);
+    for (t = 0, total = 0; t < nchunks; t++) {
+      if (chunk[t].irregular || (chunk[t].count > n - i - total)) {
+        break;
+      }
+      chunk[t].first = i + total;
+      total += chunk[t].count;
+    }
+
+    /* Parse the leading regular chunks in parallel. */
+    run_jobs(parse_chunk, chunk, sizeof(ascii_chunk), t);
+    i += total;
+    if ((i == n) && (t < nchunks)) {
+      cut = chunk[t].p - buf;
+      break;
+    } else if (t < nchunks) {
+      /* Parse the rest of the block sequentially, right up to the cut. */
+      in.f   = f;
+      in.buf = buf;
+      in.pos = chunk[t].p - buf;
+      in.len = cut;
+      in.eof = 1;
+      saved  = buf[cut];
+      buf[cut] = '\0';
+      if (bits) {
+        i += ascii_read_bits(&in, (char *)img_in + i * size, sample_type, n - i);
+      } else {
+        i += ascii_read_samples(&in, (char *)img_in + i * size, sample_type, 
+          n - i);
+      }
+      buf[cut] = saved;
+      /* The reader empties itself when it gets to the cut. */
+      s = in.pos;
+      if ((in.len != 0) && (ascii_skip(&in) != EOF)) {
+        cut = s;
+        break;
+      }
+    }
+    memmove(buf, buf + cut, len - cut);
+    len -= cut;
+    cut  = 0;
+  }
+  /* Give the bytes past the last sample back to seekable streams. */
+  if (len > cut) {
+    fseek(f, -(long)(len - cut), SEEK_CUR);
+  }
+  stats_end(st, 0, i);
+  free(buf);
+  return i;
+}
+#endif
+
+/* read_ascii_data_mt:
+ * Read n ASCII samples with nthreads threads, or sequentially if nthreads 
+ * is 1 or threads are not available.
+ */
+static void read_ascii_data_mt(FILE *f, int *img_in, size_t n, int bits,
+  int nthreads)
+{
+#if !defined(_WIN32)
+  if ((nthreads = pnm_threads(nthreads)) > 1) {
+    read_ascii_mt(f, img_in, PNM_SAMPLE_INT, n, bits, nthreads);
+    return;
+  }
+#endif
+  if (bits) {
+    read_ascii_bits(f, img_in, PNM_SAMPLE_INT, n);
+  } else {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_INT, n);
+  }
+}
+
+/* read_pbm_data_mt:
+ * Same as read_pbm_data_ex, decoding ASCII payloads with nthreads threads 
+ * (0 or less for one per online processor). 
+ */
+void read_pbm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int is_ascii, int nthreads)
+{
+  if (is_ascii == 1) {
+    read_ascii_data_mt(f, img_in, (size_t)img_xdim * img_ydim, 1, nthreads);
+  } else {
+    read_pbm_data_ex(f, img_in, img_xdim, img_ydim, is_ascii);
+  }
+}
+
+/* read_pgm_data_mt:
+ * Same as read_pgm_data_ex, decoding ASCII payloads with nthreads threads 
+ * (0 or less for one per online processor). 
+ */
+void read_pgm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii, int nthreads)
+{
+  if (is_ascii == 1) {
+    read_ascii_data_mt(f, img_in, (size_t)img_xdim * img_ydim, 0, nthreads);
+  } else {
+    read_pgm_data_ex(f, img_in, img_xdim, img_ydim, img_colors, is_ascii);
+  }
+}
+
+/* read_ppm_data_mt:
+ * Same as read_ppm_data_ex, decoding ASCII payloads with nthreads threads 
+ * (0 or less for one per online processor). 
+ */
+void read_ppm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii, int nthreads)
+{
+  if (is_ascii == 1) {
+    read_ascii_data_mt(f, img_in, 3 * (size_t)img_xdim * img_ydim, 0, 
+      nthreads);
+  } else {
+    read_ppm_data_ex(f, img_in, img_xdim, img_ydim, img_colors, is_ascii);
+  }
+}
+
+/* Two-digit decimal strings "00" to "99", for formatting ASCII samples. */
+static const char digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "7475767778798081828384858687888990919293949596979899";
+
+/* Buffered writer for ASCII (P1/P2/P3) payloads. */
+typedef struct {
+  FILE *f;
+  char *buf;
+  size_t len, cap;
+  int col;
+} ascii_out;
+
+/* ascii_flush:
+ * Write out the buffered bytes of an ASCII payload writer.
+ */
+static void ascii_flush(ascii_out *out)
+{
+  if (out->len > 0) {
+    io_write(out->buf, 1, out->len, out->f);
+    out->len = 0;
+  }
+}
+
+/* format_int:
+ * Format v in decimal at p, two digits at a time. Returns the end of the 
+ * formatted string, which is not NUL-terminated.
+ */
+static char *format_int(char *p, int v)
+{
+  char tmp[12];
+  char *t = tmp + sizeof(tmp);
+  unsigned int u;
+  size_t n;
+
+  u = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+  if (v < 0) {
+    *p++ = '-';
+  }
+  if (u < 10) {
+    *p++ = (char)('0' + u);
+    return p;
+  }
+  if (u < 100) {
+    memcpy(p, digit_pairs + 2*u, 2);
+    return p + 2;
+  }
+  while (u >= 100) {
+    t -= 2;
+    memcpy(t, digit_pairs + 2*(u % 100), 2);
+    u /= 100;
+  }
+  if (u < 10) {
+    *--t = (char)('0' + u);
+  } else {
+    t -= 2;
+    memcpy(t, digit_pairs + 2*u, 2);
+  }
+  n = tmp + sizeof(tmp) - t;
+  memcpy(p, t, n);
+  return p + n;
+}
+
+/* write_ascii_row:
+ * Format n PBM/PGM samples as "%d " each, breaking the line after every 
+ * linevals samples counted from the start of the raster.
+ */
+static void write_ascii_row(ascii_out *out, const int *row, size_t n,
+  int linevals)
+{
+  size_t j;
+  char *p;
+
+  for (j = 0; j < n; j++) {
+    if (out->len > out->cap - ASCII_MAXTOKEN) {
+      ascii_flush(out);
+    }
+    p = format_int(out->buf + out->len, row[j]);
+    *p++ = ' ';
+    if (++out->col == linevals) {
+      *p++ = '\n';
+      out->col = 0;
+    }
+    out->len = p - out->buf;
+  }
+}
+
+/* write_ascii_ppm_row:
+ * Format a row of x_size PPM pixels as "%d %d %d " each, breaking the line 
+ * after every pixel whose column is a multiple of 4.
+ */
+static void write_ascii_ppm_row(ascii_out *out, const int *row, int x_size)
+{
+  size_t j;
+  char *p;
+
+  for (j = 0; j < (size_t)x_size; j++) {
+    if (out->len > out->cap - 3*ASCII_MAXTOKEN) {
+      ascii_flush(out);
+    }
+    p = format_int(out->buf + out->len, row[3*j+0]);
+    *p++ = ' ';
+    p = format_int(p, row[3*j+1]);
+    *p++ = ' ';
+    p = format_int(p, row[3*j+2]);
+    *p++ = ' ';
+    if ((j % 4) == 0) {
+      *p++ = '\n';
+    }
+    out->len = p - out->buf;
+  }
+}
+
+/* write_pbm_row:
+ * Pack a row of x_size binary PBM pixels (nonzero meaning black) into 
+ * bytes, padding it to a byte boundary, and write it with a single fwrite.
+ */
+static void write_pbm_row(FILE *f, const void *row, int sample_type,
+  int x_size, uint8_t *bytes)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:
+      pnm_simd_pack_bits_u8(bytes, (const uint8_t *)row, x_size);
+      break;
+    default:
+      pnm_simd_pack_bits_int(bytes, (const int *)row, x_size);
+      break;
+  }
+  io_write(bytes, 1, ((size_t)x_size + 7) / 8, f);
+}
+
+/* write_u8_row:
+ * Write n samples of a PGM/PPM row as 8-bit values, clamped to 0..255, 
+ * with a single fwrite. 8-bit rows are written in place.
+ */
+static void write_u8_row(FILE *f, const void *row, int sample_type,
+  size_t n, uint8_t *bytes)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:
+      io_write(row, 1, n, f);
+      return;
+    case PNM_SAMPLE_U16:
+      pnm_simd_narrow_u16_u8(bytes, (const uint16_t *)row, n);
+      break;
+    default:
+      pnm_simd_narrow_int_u8(bytes, (const int *)row, n);
+      break;
+  }
+  io_write(bytes, 1, n, f);
+}
+
+/* write_be16_row:
+ * Write n samples of a PGM/PPM row as big-endian 16-bit values, as used for
+ * binary files with maxval above 255, with a single fwrite.
+ */
+static void write_be16_row(FILE *f, const void *row, int sample_type,
+  size_t n, uint16_t *be)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:
+      pnm_simd_widen_u8_u16(be, (const uint8_t *)row, n);
+      break;
+    case PNM_SAMPLE_U16:
+      memcpy(be, row, n * sizeof(uint16_t));
+      break;
+    default:
+      pnm_simd_narrow_int_u16(be, (const int *)row, n);
+      break;
+  }
+  if (IS_LITTLE_ENDIAN) {
+    pnm_simd_bswap16(be, be, n);
+  }
+  io_write(be, sizeof(uint16_t), n, f);
+}
+
+/* Row writer state, shared by the write_*_file functions and the 
+ * pnm_writer_* API.
+ */
+struct pnm_writer {
+  FILE *f;
+  pnm_info info;
+  int sample_type;
+  int linevals;
+  int is_ascii, is_pbm, is_pfm, wide, swap;
+  size_t row_len, row_size;
+  int row;                  /* rows written so far */
+  int *tmp;                 /* int row, for ASCII output */
+  uint8_t *bytes;           /* packed/narrowed/swapped row */
+  uint16_t *be;             /* big-endian 16-bit row */
+  ascii_out out;
+};
+
+/* info_depth:
+ * Return the number of samples per pixel of an image described by info; 
+ * the depth field only counts for PAM images.
+ */
+static int info_depth(const pnm_info *info)
+{
+  switch (info->pnm_type) {
+    case PPM_ASCII: case PPM_BINARY: case PFM_RGB:
+      return 3;
+    case PAM:
+      return info->depth;
+    default:
+      return 1;
+  }
+}
+
+/* writer_check:
+ * Check that an image described by info can be written from buffers of the
+ * given sample type.
+ */
+static int writer_check(int sample_type, const pnm_info *info)
+{
+  int type = info->pnm_type;
+
+  if (((type < PBM_ASCII) || (type > PAM)) && 
+      (type != PFM_RGB) && (type != PFM_GREYSCALE)) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if ((type == PAM) && 
+      ((info->depth < 1) || 
+       (memchr(info->tupltype, '\0', PNM_TUPLTYPE_LEN) == NULL) ||
+       (strchr(info->tupltype, '\n') != NULL))) {
+    return PNM_ERR_RANGE;
+  }
+  if (((type == PFM_RGB) || (type == PFM_GREYSCALE)) != 
+      (sample_type == PNM_SAMPLE_FLOAT)) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if (!image_fits(info->width, info->height, info_depth(info)) || 
+      ((type != PBM_ASCII) && (type != PBM_BINARY) && (type < PFM_RGB) && 
+       ((info->maxval < 1) || (info->maxval > 65535)))) {
+    return PNM_ERR_RANGE;
+  }
+  return PNM_OK;
+}
+
+/* writer_header:
+ * Write the header of an image described by info for w, with the PFM scale
+ * sign given by big. Returns the number of bytes written; the number of 
+ * stdio calls is stored in *ncalls.
+ */
+static int writer_header(pnm_writer *w, const pnm_info *info, int big,
+  size_t *ncalls)
+{
+  FILE *f = w->f;
+  int n;
+
+  /* PAM headers consist of keyword lines. */
+  if (info->pnm_type == PAM) {
+    n = fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\n", 
+      info->width, info->height, info->depth, info->maxval);
+    *ncalls = 2;
+    if (info->tupltype[0] != '\0') {
+      n += fprintf(f, "TUPLTYPE %s\n", info->tupltype);
+      *ncalls = 3;
+    }
+    n += fprintf(f, "ENDHDR\n");
+    return n;
+  }
+
+  /* Write the magic number string and the image dimensions. */
+  n  = fprintf(f, "%s\n", hdr_magic(info->pnm_type));
+  n += fprintf(f, "%d %d\n", info->width, info->height);
+  *ncalls = 3;
+  /* Write the maximum color/grey level allowed, or the PFM scale. */
+  if (w->is_pfm) {
+    n += fprintf(f, "%f\n", big ? +1.0 : -1.0);
+  } else if (!w->is_pbm) {
+    n += fprintf(f, "%d\n", info->maxval);
+  } else {
+    *ncalls = 2;
+  }
+  return n;
+}
+
+/* writer_init:
+ * Set up w for writing an image described by info (pnm_type, width, height
+ * and maxval; endianess for PFM) from buffers of the given sample type, and
+ * write the header. PFM floats are written in the byte order given by the 
+ * sign of info->endianess, or in host order if it is 0.
+ */
+static int writer_init(pnm_writer *w, FILE *f, int sample_type,
+  const pnm_info *info, int linevals)
+{
+  int type = info->pnm_type;
+  stats_slot *t;
+  uint64_t start;
+  size_t ncalls;
+  int big, nbytes;
+
+  w->f           = f;
+  w->info        = *info;
+  w->sample_type = sample_type;
+  w->linevals    = linevals;
+  w->is_ascii    = (type <= PPM_ASCII) ? 1 : 0;
+  w->is_pbm      = ((type == PBM_ASCII) || (type == PBM_BINARY)) ? 1 : 0;
+  w->is_pfm      = ((type == PFM_RGB) || (type == PFM_GREYSCALE)) ? 1 : 0;
+  w->info.depth  = info_depth(info);
+  w->wide        = !w->is_ascii && !w->is_pbm && !w->is_pfm && 
+                   (info->maxval > 255);
+  w->row_len     = (size_t)info->width * w->info.depth;
+  w->row_size    = w->row_len * pnm_sample_size(sample_type);
+  w->row         = 0;
+  w->tmp         = NULL;
+  w->bytes       = NULL;
+  w->be          = NULL;
+  w->out.f       = f;
+  w->out.buf     = NULL;
+  w->out.len     = 0;
+  w->out.cap     = ASCIIBUF_SIZE;
+  w->out.col     = 0;
+  big = (info->endianess > 0) || ((info->endianess == 0) && !IS_LITTLE_ENDIAN);
+  w->info.endianess = w->is_pfm ? (big ? 1 : -1) : 0;
+  w->swap        = w->is_pfm && (big == IS_LITTLE_ENDIAN);
+
+  if ((w->is_ascii && (sample_type != PNM_SAMPLE_INT) && 
+       ((w->tmp = malloc(w->row_len * sizeof(int))) == NULL)) ||
+      (!w->is_ascii && !w->wide && 
+       ((w->bytes = malloc(w->row_len * sizeof(float) + 8)) == NULL)) ||
+      (w->wide && ((w->be = malloc(w->row_len * sizeof(uint16_t))) == NULL)) ||
+      (w->is_ascii && ((w->out.buf = malloc(ASCIIBUF_SIZE)) == NULL))) {
+    free(w->tmp);
+    free(w->bytes);
+    free(w->be);
+    free(w->out.buf);
+    return PNM_ERR_NOMEM;
+  }
+
+  t = stats_slot_get();
+  start = (t != NULL) ? stats_now() : 0;
+  nbytes = writer_header(w, info, big, &ncalls);
+  stats_header(t, start, 1, ncalls, (nbytes > 0) ? (size_t)nbytes : 0);
+  return PNM_OK;
+}
+
+/* writer_put_rows:
+ * Write nrows rows from img_out, which start stride bytes apart (0 for 
+ * packed rows). Binary rows are packed, narrowed or byte-swapped straight 
+ * from the buffer; rows of ASCII files are widened to int first when 
+ * needed.
+ */
+static void writer_put_rows(pnm_writer *w, const void *img_out, size_t stride,
+  int nrows)
+{
+  stats_slot *t = stats_begin();
+  const char *src;
+  const int *row;
+  int i;
+
+  if (stride == 0) {
+    stride = w->row_size;
+  }
+  /* 8-bit binary rows are stored as they are: write packed rows all at 
+   * once, and padded ones one by one.
+   */
+  if (!w->is_ascii && !w->is_pbm && !w->is_pfm && !w->wide && 
+      (w->sample_type == PNM_SAMPLE_U8)) {
+    if (stride == w->row_size) {
+      io_write(img_out, w->row_size, (size_t)nrows, w->f);
+    } else {
+      for (i = 0; i < nrows; i++) {
+        io_write((const char *)img_out + i * stride, 1, w->row_size, w->f);
+      }
+    }
+    w->row += nrows;
+    stats_end(t, 1, (size_t)nrows * w->row_len);
+    return;
+  }
+  for (i = 0; i < nrows; i++, w->row++) {
+    src = (const char *)img_out + i * stride;
+    if (w->is_pfm) {
+      if (w->swap) {
+        pnm_simd_bswap32(w->bytes, src, w->row_len);
+        src = (const char *)w->bytes;
+      }
+      io_write(src, sizeof(float), w->row_len, w->f);
+      continue;
+    } else if (w->wide) {
+      write_be16_row(w->f, src, w->sample_type, w->row_len, w->be);
+      continue;
+    } else if (!w->is_ascii && w->is_pbm) {
+      write_pbm_row(w->f, src, w->sample_type, w->info.width, w->bytes);
+      continue;
+    } else if (!w->is_ascii) {
+      write_u8_row(w->f, src, w->sample_type, w->row_len, w->bytes);
+      continue;
+    }
+    switch (w->sample_type) {
+      case PNM_SAMPLE_U8:
+        pnm_simd_widen_u8_int(w->tmp, (const uint8_t *)src, w->row_len);
+        row = w->tmp;
+        break;
+      case PNM_SAMPLE_U16:
+        pnm_simd_widen_u16_int(w->tmp, (const uint16_t *)src, w->row_len);
+        row = w->tmp;
+        break;
+      default:
+        row = (const int *)src;
+        break;
+    }
+    if (w->info.depth == 3) {
+      write_ascii_ppm_row(&w->out, row, w->info.width);
+    } else {
+      write_ascii_row(&w->out, row, w->row_len, w->linevals);
+    }
+  }
+  stats_end(t, 1, (size_t)nrows * w->row_len);
+}
+
+/* writer_finish:
+ * Flush any buffered output of w and release its row buffers.
+ */
+static void writer_finish(pnm_writer *w)
+{
+  if (w->is_ascii) {
+    ascii_flush(&w->out);
+  }
+  free(w->out.buf);
+  free(w->tmp);
+  free(w->bytes);
+  free(w->be);
+  w->out.buf = NULL;
+  w->tmp     = NULL;
+  w->bytes   = NULL;
+  w->be      = NULL;
+}
+
+/* writer_put_scaled:
+ * Write an x_size by y_size raster of packed rows from img_out, enlarged 
+ * x_scale times across and y_scale times down by pixel replication. Each 
+ * row is replicated across once, and the enlarged row is then written 
+ * y_scale times, so no enlarged image is ever held in memory. Returns 
+ * PNM_OK, or PNM_ERR_NOMEM if the row buffer cannot be allocated.
+ */
+static int writer_put_scaled(pnm_writer *w, const void *img_out, int x_size,
+  int y_size, int x_scale, int y_scale)
+{
+  size_t pixel_size = (size_t)w->info.depth * pnm_sample_size(w->sample_type);
+  size_t src_size = (size_t)x_size * pixel_size;
+  stats_slot *t;
+  const char *src;
+  char *row = NULL;
+  int y, k;
+
+  if ((x_scale > 1) && ((row = malloc(w->row_size)) == NULL)) {
+    return PNM_ERR_NOMEM;
+  }
+  t = stats_begin();
+  for (y = 0; y < y_size; y++) {
+    src = (const char *)img_out + y * src_size;
+    if (row != NULL) {
+      pnm_simd_replicate(row, src, (size_t)x_size, pixel_size, x_scale);
+      src = row;
+    }
+    for (k = 0; k < y_scale; k++) {
+      writer_put_rows(w, src, 0, 1);
+    }
+  }
+  stats_end(t, 1, (size_t)y_size * y_scale * w->row_len);
+  free(row);
+  return PNM_OK;
+}
+
+/* scaled_size:
+ * Return an image dimension multiplied by a scale factor, exiting if the 
+ * result does not fit an int.
+ */
+static int scaled_size(int size, int scale)
+{
+  if ((size < 0) || (scale < 1) || (size > INT_MAX / scale)) {
+    fprintf(stderr, "Error: Scaled image dimensions out of range!\n");
+    exit(1);
+  }
+  return size * scale;
+}
+
+/* write_pnm_file:
+ * Write the header and the raster of a PBM/PGM/PPM file from an x_size by 
+ * y_size buffer of the given sample type, enlarged x_scale by y_scale 
+ * times by pixel replication.
+ */
+static void write_pnm_file(FILE *f, const void *img_out, int sample_type,
+  int pnm_type, int x_size, int y_size, int x_scale, int y_scale, 
+  int img_colors, int linevals)
+{
+  pnm_writer w;
+  pnm_info info;
+  int err = PNM_OK;
+
+  info.pnm_type  = pnm_type;
+  info.width     = scaled_size(x_size, x_scale);
+  info.height    = scaled_size(y_size, y_scale);
+  info.depth     = 0;
+  info.maxval    = img_colors;
+  info.endianess = 0;
+  if (!image_fits(info.width, info.height, info_depth(&info))) {
+    fprintf(stderr, "Error: Image dimensions out of range!\n");
+    exit(1);
+  }
+  if (writer_init(&w, f, sample_type, &info, linevals) != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  if ((x_scale == 1) && (y_scale == 1)) {
+    writer_put_rows(&w, img_out, 0, y_size);
+  } else {
+    err = writer_put_scaled(&w, img_out, x_size, y_size, x_scale, y_scale);
+  }
+  writer_finish(&w);
+  if (err != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+}
+
+/* write_pbm_file:
+ * Write the contents of a PBM (portable bit map) file.
+ */
+void write_pbm_file(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals,
+  int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_INT, 
+    (is_ascii == 1) ? PBM_ASCII : PBM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, 1, linevals);
+}
+
+/* write_pgm_file:
+ * Write the contents of a PGM (portable grey map) file.
+ */
+void write_pgm_file(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int linevals, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_INT, 
+    (is_ascii == 1) ? PGM_ASCII : PGM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, linevals);
+}
+
+/* write_ppm_file:
+ * Write the contents of a PPM (portable pix map) file.
+ */
+void write_ppm_file(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_INT, 
+    (is_ascii == 1) ? PPM_ASCII : PPM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, 0);
+}
+
+/* write_pfm_file:
+ * Write the contents of a PFM (portable float map) file from floats in 
+ * host byte order: big-endian, with a scale of +1.0, if endianess is 1, 
+ * and little-endian, with a scale of -1.0, otherwise.
+ */
+void write_pfm_file(FILE *f, float *img_out,
+  int x_size, int y_size, 
+  int img_type, int endianess)
+{
+  pnm_writer w;
+  pnm_info info;
+
+  if ((img_type != RGB_TYPE) && (img_type != GREYSCALE_TYPE)) {
+    fprintf(stderr, "Error: Image type invalid for PFM format!\n");
+    exit(1);    
+  }
+  info.pnm_type  = (img_type == RGB_TYPE) ? PFM_RGB : PFM_GREYSCALE;
+  info.width     = x_size;
+  info.height    = y_size;
+  info.depth     = 0;
+  info.maxval    = 0;
+  info.endianess = (endianess == 1) ? 1 : -1;
+  if (!image_fits(x_size, y_size, info_depth(&info))) {
+    fprintf(stderr, "Error: Image dimensions out of range!\n");
+    exit(1);
+  }
+  if (writer_init(&w, f, PNM_SAMPLE_FLOAT, &info, 0) != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  writer_put_rows(&w, img_out, 0, y_size);
+  writer_finish(&w);
+}
+
+/* write_pam_file:
+ * Write the contents of a PAM (portable arbitrary map) file with depth 
+ * samples per tuple and an optional tuple type (NULL or "" for none), such 
+ * as "RGB_ALPHA" or "GRAYSCALE_ALPHA".
+ */
+void write_pam_file(FILE *f, int *img_out,
+  int x_size, int y_size, int depth, int img_colors, const char *tupltype)
+{
+  pnm_writer w;
+  pnm_info info;
+
+  info.pnm_type  = PAM;
+  info.width     = x_size;
+  info.height    = y_size;
+  info.depth     = depth;
+  info.maxval    = img_colors;
+  info.endianess = 0;
+  info.tupltype[0] = '\0';
+  if (tupltype != NULL) {
+    strncat(info.tupltype, tupltype, PNM_TUPLTYPE_LEN - 1);
+  }
+  if (writer_check(PNM_SAMPLE_INT, &info) != PNM_OK) {
+    fprintf(stderr, "Error: Invalid PAM image parameters!\n");
+    exit(1);
+  }
+  if (writer_init(&w, f, PNM_SAMPLE_INT, &info, 0) != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  writer_put_rows(&w, img_out, 0, y_size);
+  writer_finish(&w);
+}
+
+/* Multi-threaded ASCII encode. */
+
+#if !defined(_WIN32)
+/* Output buffer for one job of a parallel ASCII encoder. */
+typedef struct {
+  char *buf;
+  size_t len;
+  int ready;                /* formatted, waiting to be written */
+  int *row;                 /* enlarged row, when scaling across */
+} ascii_slot;
+
+/* Parallel ASCII encoder state. Jobs are runs of rows, formatted in any 
+ * order into a ring of slots and written in sequence.
+ */
+typedef struct {
+  const int *img_out;
+  int x_size, y_size, depth, linevals;    /* of the written raster */
+  int x_scale, y_scale;     /* pixel replication factors */
+  int job_rows, njobs;
+  int next_job;             /* next job to format */
+  int next_write;           /* next job to write */
+  int nslots;
+  ascii_slot slot[2 * PNM_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ascii_enc;
+
+/* format_job:
+ * Format the rows of job j into out. The line breaks of PBM/PGM files 
+ * depend on the index of the first sample, so they come out exactly as 
+ * from a single writer. When enlarging, source rows are replicated across
+ * into row, and a repeated row whose line breaks fall in the same places 
+ * is copied from the text of the previous one.
+ */
+static void format_job(ascii_enc *e, int j, ascii_out *out, int *row)
+{
+  size_t row_len = (size_t)e->x_size * e->depth;
+  size_t src_len = row_len / e->x_scale;
+  size_t first = (size_t)j * e->job_rows, start = 0, text = 0;
+  const int *src;
+  int y, col = 0, nrows = e->job_rows;
+
+  if (first + nrows > (size_t)e->y_size) {
+    nrows = e->y_size - (int)first;
+  }
+  out->len = 0;
+  out->col = (e->linevals > 0) ? (int)(first * row_len % e->linevals) : 0;
+  if ((e->x_scale > 1) || (e->y_scale > 1)) {
+    for (y = 0; y < nrows; y++) {
+      if ((y > 0) && ((first + y) % e->y_scale != 0) && (out->col == col)) {
+        memcpy(out->buf + out->len, out->buf + start, text);
+        out->len += text;
+        continue;
+      }
+      src = e->img_out + (first + y) / e->y_scale * src_len;
+      if ((e->x_scale > 1) && ((y == 0) || ((first + y) % e->y_scale == 0))) {
+        pnm_simd_replicate(row, src, src_len / e->depth, 
+          e->depth * sizeof(int), e->x_scale);
+      }
+      if (e->x_scale > 1) {
+        src = row;
+      }
+      start = out->len;
+      col   = out->col;
+      if (e->depth == 3) {
+        write_ascii_ppm_row(out, src, e->x_size);
+      } else {
+        write_ascii_row(out, src, row_len, e->linevals);
+      }
+      text = out->len - start;
+    }
+  } else if (e->depth == 3) {
+    for (y = 0; y < nrows; y++) {
+      write_ascii_ppm_row(out, e->img_out + (first + y) * row_len, e->x_size);
+    }
+  } else {
+    write_ascii_row(out, e->img_out + first * row_len, nrows * row_len,
+      e->linevals);
+  }
+}
+
+/* encode_worker:
+ * Format jobs for as long as there are any left, waiting while all slots 
+ * hold output that has not been written yet.
+ */
+static void *encode_worker(void *arg)
+{
+  ascii_enc *e = arg;
+  ascii_slot *s;
+  ascii_out out;
+  int j;
+
+  for (;;) {
+    pthread_mutex_lock(&e->lock);
+    while ((e->next_job < e->njobs) && 
+           (e->next_job >= e->next_write + e->nslots)) {
+      pthread_cond_wait(&e->cond, &e->lock);
+    }
+    if (e->next_job >= e->njobs) {
+      pthread_mutex_unlock(&e->lock);
+      return NULL;
+    }
+    j = e->next_job++;
+    pthread_mutex_unlock(&e->lock);
+
+    s = &e->slot[j % e->nslots];
+    out.buf = s->buf;
+    out.cap = (size_t)-1;
+    format_job(e, j, &out, s->row);
+
+    pthread_mutex_lock(&e->lock);
+    s->len   = out.len;
+    s->ready = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+  }
+}
+
+/* write_ascii_mt:
+ * Write the x_size by y_size raster of an ASCII PBM/PGM/PPM file with 
+ * nthreads formatting threads, while the calling thread writes their 
+ * output in order. The raster is img_out enlarged x_scale by y_scale 
+ * times by pixel replication. Returns PNM_OK, or PNM_ERR_NOMEM if the output buffers cannot be 
+ * allocated, in which case nothing is written.
+ */
+static int write_ascii_mt(FILE *f, const int *img_out, int x_size, 
+  int y_size, int x_scale, int y_scale, int depth, int linevals, 
+  int nthreads)
+{
+  ascii_enc e;
+  ascii_slot *s;
+  ascii_out out;
+  pthread_t tid[PNM_MAX_THREADS];
+  size_t row_len = (size_t)x_size * depth, cap;
+  stats_slot *st = stats_begin();
+  int t, j, nworkers=0, err = PNM_OK;
+
+  e.img_out  = img_out;
+  e.x_size   = x_size;
+  e.y_size   = y_size;
+  e.depth    = depth;
+  e.linevals = linevals;
+  e.x_scale  = x_scale;
+  e.y_scale  = y_scale;
+  e.job_rows = (row_len < ASCII_MT_JOB) ? (int)(ASCII_MT_JOB / row_len) : 1;
+  e.njobs    = y_size / e.job_rows + (y_size % e.job_rows != 0);
+  e.next_job   = 0;
+  e.next_write = 0;
+  e.nslots   = 2 * nthreads;
+  cap = (size_t)e.job_rows * row_len * ASCII_MAXBYTES;
+  for (t = 0; t < e.nslots; t++) {
+    e.slot[t].ready = 0;
+    e.slot[t].row   = NULL;
+    if (((e.slot[t].buf = malloc(cap)) == NULL) ||
+        ((x_scale > 1) && 
+         ((e.slot[t].row = malloc(row_len * sizeof(int))) == NULL))) {
+      err = PNM_ERR_NOMEM;
+    }
+  }
+  pthread_mutex_init(&e.lock, NULL);
+  pthread_cond_init(&e.cond, NULL);
+  for (t = 0; (t < nthreads) && (err == PNM_OK); t++) {
+    if (pthread_create(&tid[nworkers], NULL, encode_worker, &e) == 0) {
+      nworkers++;
+    }
+  }
+
+  /* Write the jobs in sequence as they become ready. */
+  for (j = 0; (j < e.njobs) && (err == PNM_OK); j++) {
+    s = &e.slot[j % e.nslots];
+    if (nworkers == 0) {
+      /* No thread could be started; format the job here. */
+      out.buf = s->buf;
+      out.cap = (size_t)-1;
+      format_job(&e, j, &out, s->row);
+      s->len   = out.len;
+      s->ready = 1;
+    }
+    pthread_mutex_lock(&e.lock);
+    while (!s->ready) {
+      pthread_cond_wait(&e.cond, &e.lock);
+    }
+    pthread_mutex_unlock(&e.lock);
+    io_write(s->buf, 1, s->len, f);
+    pthread_mutex_lock(&e.lock);
+    s->ready = 0;
+    e.next_write++;
+    pthread_cond_broadcast(&e.cond);
+    pthread_mutex_unlock(&e.lock);
+  }
+
+  for (t = 0; t < nworkers; t++) {
+    pthread_join(tid[t], NULL);
+  }
+  pthread_cond_destroy(&e.cond);
+  pthread_mutex_destroy(&e.lock);
+  for (t = 0; t < e.nslots; t++) {
+    free(e.slot[t].buf);
+    free(e.slot[t].row);
+  }
+  stats_end(st, 1, (err == PNM_OK) ? (size_t)y_size * row_len : 0);
+  return err;
+}
+#endif
+
+/* write_pnm_file_mt:
+ * Same as write_pnm_file for int buffers, formatting ASCII rasters with 
+ * nthreads threads (0 or less for one per online processor). The output is
+ * byte-identical to that of write_pnm_file.
+ */
+static void write_pnm_file_mt(FILE *f, const int *img_out, int pnm_type,
+  int x_size, int y_size, int x_scale, int y_scale, int img_colors, 
+  int linevals, int nthreads)
+{
+#if !defined(_WIN32)
+  pnm_writer w;
+  pnm_info info;
+
+  info.pnm_type  = pnm_type;
+  info.width     = scaled_size(x_size, x_scale);
+  info.height    = scaled_size(y_size, y_scale);
+  info.depth     = 0;
+  info.maxval    = img_colors;
+  info.endianess = 0;
+  if ((pnm_type <= PPM_ASCII) && image_fits(info.width, info.height, 3) &&
+      ((nthreads = pnm_threads(nthreads)) > 1)) {
+    if ((writer_init(&w, f, PNM_SAMPLE_INT, &info, linevals) != PNM_OK) ||
+        (write_ascii_mt(f, img_out, info.width, info.height, x_scale, 
+           y_scale, w.info.depth, linevals, nthreads) != PNM_OK)) {
+      fprintf(stderr, "Error: Out of memory!\n");
+      exit(1);
+    }
+    writer_finish(&w);
+    return;
+  }
+#endif
+  write_pnm_file(f, img_out, PNM_SAMPLE_INT, pnm_type, x_size, y_size,
+    x_scale, y_scale, img_colors, linevals);
+}
+
+/* write_pbm_file_mt:
+ * Same as write_pbm_file, formatting ASCII files with nthreads threads (0 
+ * or less for one per online processor).
+ */
+void write_pbm_file_mt(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals,
+  int is_ascii, int nthreads)
+{
+  write_pnm_file_mt(f, img_out, (is_ascii == 1) ? PBM_ASCII : PBM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, 1, linevals, nthreads);
+}
+
+/* write_pgm_file_mt:
+ * Same as write_pgm_file, formatting ASCII files with nthreads threads (0 
+ * or less for one per online processor).
+ */
+void write_pgm_file_mt(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int linevals, int is_ascii, int nthreads)
+{
+  write_pnm_file_mt(f, img_out, (is_ascii == 1) ? PGM_ASCII : PGM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, linevals, nthreads);
+}
+
+/* write_ppm_file_mt:
+ * Same as write_ppm_file, formatting ASCII files with nthreads threads (0 
+ * or less for one per online processor).
+ */
+void write_ppm_file_mt(FILE *f, int *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int is_ascii, int nthreads)
+{
+  write_pnm_file_mt(f, img_out, (is_ascii == 1) ? PPM_ASCII : PPM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, 0, nthreads);
+}
+
+/* pnm_sample_type:
+ * Return the narrowest sample type able to hold values up to img_colors:
+ * PNM_SAMPLE_U8 for maxval up to 255, PNM_SAMPLE_U16 otherwise.
+ */
+int pnm_sample_type(int img_colors)
+{
+  return (img_colors > 255) ? PNM_SAMPLE_U16 : PNM_SAMPLE_U8;
+}
+
+/* pnm_sample_size:
+ * Return the size in bytes of a sample of the given type.
+ */
+size_t pnm_sample_size(int sample_type)
+{
+  switch (sample_type) {
+    case PNM_SAMPLE_U8:    return sizeof(uint8_t);
+    case PNM_SAMPLE_U16:   return sizeof(uint16_t);
+    case PNM_SAMPLE_FLOAT: return sizeof(float);
+    default:               return sizeof(int);
+  }
+}
+
+/* pnm_image_alloc:
+ * Allocate a buffer for the raster of an image described by info, with 
+ * samples of the given type. Each row starts on a PNM_ALIGN-byte boundary 
+ * and is padded with zeros to a multiple of PNM_ALIGN bytes, so SIMD code
+ * may load whole vectors past the last sample of a row. The row stride in 
+ * bytes is stored in *stride. Returns NULL if the image is empty or too 
+ * large, or if memory runs out. The buffer is released with pnm_image_free.
+ */
+void *pnm_image_alloc(const pnm_info *info, int sample_type, size_t *stride)
+{
+  size_t size = pnm_sample_size(sample_type), row_size, pitch;
+  int depth = info_depth(info), y;
+  void *buf;
+
+  *stride = 0;
+  if ((info->width <= 0) || (info->height <= 0) || (depth <= 0) ||
+      ((size_t)info->width > (SIZE_MAX - PNM_ALIGN) / depth / size)) {
+    return NULL;
+  }
+  row_size = (size_t)info->width * depth * size;
+  pitch    = (row_size + PNM_ALIGN - 1) / PNM_ALIGN * PNM_ALIGN;
+  if ((size_t)info->height > SIZE_MAX / pitch) {
+    return NULL;
+  }
+#if !defined(_WIN32)
+  if (posix_memalign(&buf, PNM_ALIGN, (size_t)info->height * pitch) != 0) {
+    return NULL;
+  }
+#else
+  if ((buf = _aligned_malloc((size_t)info->height * pitch, PNM_ALIGN)) == NULL) {
+    return NULL;
+  }
+#endif
+  if (pitch > row_size) {
+    for (y = 0; y < info->height; y++) {
+      memset((char *)buf + y * pitch + row_size, 0, pitch - row_size);
+    }
+  }
+  *stride = pitch;
+  return buf;
+}
+
+/* pnm_image_free:
+ * Release a buffer allocated by pnm_image_alloc.
+ */
+void pnm_image_free(void *buf)
+{
+#if !defined(_WIN32)
+  free(buf);
+#else
+  _aligned_free(buf);
+#endif
+}
+
+/* read_pbm_data_u8:
+ * Read the data contents of a PBM file into 8-bit samples (one per pixel).
+ */
+void read_pbm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+  int is_ascii)
+{
+  read_pbm_samples(f, img_in, PNM_SAMPLE_U8, img_xdim, img_ydim, is_ascii);
+}
+
+/* read_pgm_data_u8:
+ * Read the data contents of a PGM file with maxval up to 255 into 8-bit 
+ * samples.
+ */
+void read_pgm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = (size_t)img_xdim * img_ydim;
+
+  check_u8_colors(img_colors);
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_U8, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_U8, 1, n);
+  }
+}
+
+/* read_pgm_data_u16:
+ * Read the data contents of a PGM file into 16-bit samples.
+ */
+void read_pgm_data_u16(FILE *f, uint16_t *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = (size_t)img_xdim * img_ydim;
+
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_U16, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_U16, 
+      (img_colors > 255) ? 2 : 1, n);
+  }
+}
+
+/* read_ppm_data_u8:
+ * Read the data contents of a PPM file with maxval up to 255 into 8-bit 
+ * samples (R, G, B interleaved).
+ */
+void read_ppm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = 3 * (size_t)img_xdim * img_ydim;
+
+  check_u8_colors(img_colors);
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_U8, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_U8, 1, n);
+  }
+}
+
+/* read_ppm_data_u16:
+ * Read the data contents of a PPM file into 16-bit samples (R, G, B 
+ * interleaved).
+ */
+void read_ppm_data_u16(FILE *f, uint16_t *img_in, int img_xdim, int img_ydim,
+  int img_colors, int is_ascii)
+{
+  size_t n = 3 * (size_t)img_xdim * img_ydim;
+
+  if (is_ascii == 1) {
+    read_ascii_samples(f, img_in, PNM_SAMPLE_U16, n);
+  } else {
+    read_binary_samples(f, img_in, PNM_SAMPLE_U16, 
+      (img_colors > 255) ? 2 : 1, n);
+  }
+}
+
+/* write_pbm_file_u8:
+ * Write the contents of a PBM file from 8-bit samples (one per pixel).
+ */
+void write_pbm_file_u8(FILE *f, const uint8_t *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals,
+  int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_U8, 
+    (is_ascii == 1) ? PBM_ASCII : PBM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, 1, linevals);
+}
+
+/* write_pgm_file_u8:
+ * Write the contents of a PGM file from 8-bit samples.
+ */
+void write_pgm_file_u8(FILE *f, const uint8_t *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int linevals, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_U8, 
+    (is_ascii == 1) ? PGM_ASCII : PGM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, linevals);
+}
+
+/* write_pgm_file_u16:
+ * Write the contents of a PGM file from 16-bit samples.
+ */
+void write_pgm_file_u16(FILE *f, const uint16_t *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int linevals, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_U16, 
+    (is_ascii == 1) ? PGM_ASCII : PGM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, linevals);
+}
+
+/* write_ppm_file_u8:
+ * Write the contents of a PPM file from 8-bit samples.
+ */
+void write_ppm_file_u8(FILE *f, const uint8_t *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_U8, 
+    (is_ascii == 1) ? PPM_ASCII : PPM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, 0);
+}
+
+/* write_ppm_file_u16:
+ * Write the contents of a PPM file from 16-bit samples.
+ */
+void write_ppm_file_u16(FILE *f, const uint16_t *img_out,
+  int x_size, int y_size, int x_scale_val, int y_scale_val, 
+  int img_colors, int is_ascii)
+{
+  write_pnm_file(f, img_out, PNM_SAMPLE_U16, 
+    (is_ascii == 1) ? PPM_ASCII : PPM_BINARY, 
+    x_size, y_size, x_scale_val, y_scale_val, img_colors, 0);
+}
+
+/* Incremental row reader state. */
+struct pnm_reader {
+  FILE *f;
+  pnm_info info;
+  int sample_type;
+  int bps;                  /* bytes per binary PGM/PPM sample */
+  int swap;                 /* PFM: swap the bytes of each float */
+  int row;                  /* rows read so far */
+  size_t row_len;           /* samples per row */
+  ascii_in in;              /* ASCII formats only */
+};
+
+/* reader_setup:
+ * Set up r for reading the raster of an image described by h, whose header 
+ * has already been read from f, into buffers of the given sample type. The
+ * read-ahead buffer of ASCII formats is left to the caller.
+ */
+static int reader_setup(pnm_reader *r, FILE *f, int sample_type,
+  const pnm_info *h)
+{
+  int is_pfm = (h->pnm_type == PFM_RGB) || (h->pnm_type == PFM_GREYSCALE);
+
+  if ((is_pfm != (sample_type == PNM_SAMPLE_FLOAT)) ||
+      (((h->pnm_type == PBM_ASCII) || (h->pnm_type == PBM_BINARY)) && 
+       (sample_type == PNM_SAMPLE_U16))) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if ((sample_type == PNM_SAMPLE_U8) && (h->maxval > 255)) {
+    return PNM_ERR_RANGE;
+  }
+  r->f           = f;
+  r->info        = *h;
+  r->sample_type = sample_type;
+  r->bps         = (h->maxval > 255) ? 2 : 1;
+  r->swap        = is_pfm && ((h->endianess > 0) == IS_LITTLE_ENDIAN);
+  r->row         = 0;
+  r->row_len     = (size_t)h->width * h->depth;
+  r->in.buf      = NULL;
+  return PNM_OK;
+}
+
+/* reader_init:
+ * Same as reader_setup, with a read-ahead buffer of its own for ASCII 
+ * formats.
+ */
+static int reader_init(pnm_reader *r, FILE *f, int sample_type,
+  const pnm_info *h)
+{
+  int err;
+
+  if ((err = reader_setup(r, f, sample_type, h)) != PNM_OK) {
+    return err;
+  }
+  if ((h->pnm_type <= PPM_ASCII) && (ascii_open(&r->in, f) != PNM_OK)) {
+    return PNM_ERR_NOMEM;
+  }
+  return PNM_OK;
+}
+
+/* reader_finish:
+ * Release the read-ahead buffer of r.
+ */
+static void reader_finish(pnm_reader *r)
+{
+  if (r->in.buf != NULL) {
+    ascii_close(&r->in);
+  }
+}
+
+/* pnm_reader_open:
+ * Parse the header of the PNM/PFM file f and set up *reader for reading its
+ * raster incrementally into buffers of the given sample type. The image is 
+ * described in *info. PFM files need PNM_SAMPLE_FLOAT buffers and yield 
+ * floats in host byte order; PBM files need PNM_SAMPLE_INT or PNM_SAMPLE_U8.
+ */
+int pnm_reader_open(pnm_reader **reader, FILE *f, int sample_type,
+  pnm_info *info)
+{
+  int err;
+
+  *reader = NULL;
+  if ((err = pnm_read_header(f, info)) != PNM_OK) {
+    return err;
+  }
+  return pnm_reader_open_info(reader, f, sample_type, info);
+}
+
+/* pnm_reader_open_info:
+ * Same as pnm_reader_open for a file whose header has already been read 
+ * into info, e.g. by pnm_read_header, so that the sample type can be 
+ * chosen from the header without reading it twice. f must be positioned 
+ * at the first byte of the raster.
+ */
+int pnm_reader_open_info(pnm_reader **reader, FILE *f, int sample_type,
+  const pnm_info *info)
+{
+  pnm_reader *r;
+  int err;
+
+  *reader = NULL;
+  if ((r = malloc(sizeof(*r))) == NULL) {
+    return PNM_ERR_NOMEM;
+  }
+  if ((err = reader_init(r, f, sample_type, info)) != PNM_OK) {
+    free(r);
+    return err;
+  }
+  *reader = r;
+  return PNM_OK;
+}
+
+/* pnm_read_rows:
+ * Read the next nrows rows (fewer at the end of the image) into buf. 
+ * Returns the number of rows read, 0 past the last row, or a negative error
+ * code: PNM_ERR_FORMAT if the file is truncated or malformed.
+ */
+int pnm_read_rows(pnm_reader *reader, void *buf, int nrows)
+{
+  return pnm_read_rows_strided(reader, buf, 0, nrows);
+}
+
+/* reader_get:
+ * Read the next nrows rows of reader, packed, into buf. 
+ * Returns the number of samples read.
+ */
+static size_t reader_get(pnm_reader *reader, void *buf, int nrows)
+{
+  size_t n = (size_t)nrows * reader->row_len, got;
+
+  switch (reader->info.pnm_type) {
+    case PBM_ASCII:
+      got = ascii_read_bits(&reader->in, buf, reader->sample_type, n);
+      break;
+    case PGM_ASCII: case PPM_ASCII:
+      got = ascii_read_samples(&reader->in, buf, reader->sample_type, n);
+      break;
+    case PBM_BINARY:
+      got = read_pbm_samples(reader->f, buf, reader->sample_type, 
+              reader->info.width, nrows, 0);
+      break;
+    case PFM_RGB: case PFM_GREYSCALE:
+      got = read_float_samples(reader->f, (float *)buf, n, reader->swap);
+      break;
+    default:
+      got = read_binary_samples(reader->f, buf, reader->sample_type, 
+              reader->bps, n);
+      break;
+  }
+  reader->row += (int)(got / reader->row_len);
+  return got;
+}
+
+/* pnm_read_rows_strided:
+ * Same as pnm_read_rows for rows that start stride bytes apart in buf (0 
+ * for packed rows), such as those of a buffer from pnm_image_alloc. 
+ * Padding bytes past the end of each row are left untouched; samples are 
+ * read straight into the rows, with no intermediate copy.
+ * Returns PNM_ERR_RANGE as well if stride is shorter than a row.
+ */
+int pnm_read_rows_strided(pnm_reader *reader, void *buf, size_t stride,
+  int nrows)
+{
+  size_t row_size = reader->row_len * pnm_sample_size(reader->sample_type);
+  size_t n, got;
+  stats_slot *t;
+  int y;
+
+  if ((nrows < 0) || ((stride != 0) && (stride < row_size))) {
+    return PNM_ERR_RANGE;
+  }
+  if (nrows > reader->info.height - reader->row) {
+    nrows = reader->info.height - reader->row;
+  }
+  if (nrows == 0) {
+    return 0;
+  }
+  n = (size_t)nrows * reader->row_len;
+  t = stats_begin();
+  if ((stride == 0) || (stride == row_size)) {
+    got = reader_get(reader, buf, nrows);
+  } else {
+    for (y = 0, got = 0; y < nrows; y++) {
+      got += reader_get(reader, (char *)buf + y * stride, 1);
+      if (got < (size_t)(y + 1) * reader->row_len) {
+        break;
+      }
+    }
+  }
+  stats_end(t, 0, got);
+  return (got < n) ? PNM_ERR_FORMAT : nrows;
+}
+
+/* pnm_reader_close:
+ * Release a reader. The file itself is left open.
+ */
+void pnm_reader_close(pnm_reader *reader)
+{
+  if (reader == NULL) {
+    return;
+  }
+  reader_finish(reader);
+  free(reader);
+}
+
+/* Multi-image stream state. ASCII read-ahead is carried over from one frame
+ * to the next, so that frames can be read from pipes.
+ */
+struct pnm_frames {
+  FILE *f;
+  int sample_type;
+  ascii_in in;              /* once an ASCII frame has been seen */
+  void *buf;                /* frame buffer, reused from frame to frame */
+  size_t buf_size;
+};
+
+/* pnm_frames_open:
+ * Set up *frames for reading the images stored back to back in f, one 
+ * frame at a time, into a buffer of the given sample type (see 
+ * pnm_reader_open; PFM frames always come as floats).
+ */
+int pnm_frames_open(pnm_frames **frames, FILE *f, int sample_type)
+{
+  pnm_frames *fr;
+
+  *frames = NULL;
+  if ((sample_type < PNM_SAMPLE_INT) || (sample_type > PNM_SAMPLE_U16)) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if ((fr = malloc(sizeof(*fr))) == NULL) {
+    return PNM_ERR_NOMEM;
+  }
+  fr->f           = f;
+  fr->sample_type = sample_type;
+  fr->in.buf      = NULL;
+  fr->buf         = NULL;
+  fr->buf_size    = 0;
+  *frames = fr;
+  return PNM_OK;
+}
+
+/* pnm_frames_next:
+ * Read the header and exactly the raster of the next frame, stopping at 
+ * the frame boundary. The frame is described in *info and *buf points to 
+ * its samples, which remain valid until the next call. Returns 1, 0 at the 
+ * end of the stream, or a negative error code.
+ */
+int pnm_frames_next(pnm_frames *frames, pnm_info *info, void **buf)
+{
+  pnm_frames *fr = frames;
+  hdr_src s = { fr->f, NULL, NULL, 0, 0, 0 };
+  hdr_info h;
+  pnm_reader r;
+  size_t n, size;
+  void *p;
+  int c, err, sample_type;
+
+  *buf = NULL;
+  /* Bytes read ahead with the previous frame come first. */
+  if (fr->in.buf != NULL) {
+    s.p   = fr->in.buf + fr->in.pos;
+    s.end = fr->in.buf + fr->in.len;
+  }
+  if ((c = hdr_next(&s)) == EOF) {
+    return 0;
+  }
+  hdr_ungetc(&s, c);
+  if ((err = hdr_parse(&s, &h)) != PNM_OK) {
+    return err;
+  }
+  if (fr->in.buf != NULL) {
+    fr->in.pos = s.p - fr->in.buf;
+    if (fr->in.pos >= fr->in.len) {
+      fr->in.pos = 0;
+      fr->in.len = 0;
+      fr->in.eof = 0;
+    } else if (h.pnm_type > PPM_ASCII) {
+      /* A binary frame after an ASCII one: give the bytes back. */
+      if (fseek(fr->f, -(long)(fr->in.len - fr->in.pos), SEEK_CUR) != 0) {
+        return PNM_ERR_UNSUPPORTED;
+      }
+      fr->in.pos = 0;
+      fr->in.len = 0;
+      fr->in.eof = 0;
+    }
+  }
+  info->pnm_type  = h.pnm_type;
+  info->width     = h.xdim;
+  info->height    = h.ydim;
+  info->depth     = h.depth;
+  info->maxval    = h.maxval;
+  info->endianess = (h.scale > 0.0) ? 1 : ((h.scale < 0.0) ? -1 : 0);
+  strcpy(info->tupltype, h.tupltype);
+
+  /* Grow the frame buffer if needed. */
+  sample_type = ((h.pnm_type == PFM_RGB) || (h.pnm_type == PFM_GREYSCALE)) ?
+                PNM_SAMPLE_FLOAT : fr->sample_type;
+  size = pnm_sample_size(sample_type) * h.depth;
+  if ((size_t)h.xdim > SIZE_MAX / size / (size_t)h.ydim) {
+    return PNM_ERR_RANGE;
+  }
+  n = size * h.xdim * h.ydim;
+  if (n > fr->buf_size) {
+    if ((p = realloc(fr->buf, n)) == NULL) {
+      return PNM_ERR_NOMEM;
+    }
+    fr->buf      = p;
+    fr->buf_size = n;
+  }
+
+  if ((err = reader_setup(&r, fr->f, sample_type, info)) != PNM_OK) {
+    return err;
+  }
+  if (h.pnm_type <= PPM_ASCII) {
+    if ((fr->in.buf == NULL) && (ascii_open(&fr->in, fr->f) != PNM_OK)) {
+      return PNM_ERR_NOMEM;
+    }
+    r.in = fr->in;
+  }
+  err = pnm_read_rows(&r, fr->buf, h.ydim);
+  if (h.pnm_type <= PPM_ASCII) {
+    fr->in = r.in;
+  }
+  if (err < 0) {
+    return err;
+  }
+  *buf = fr->buf;
+  return 1;
+}
+
+/* pnm_frames_close:
+ * Release a frame reader and its frame buffer. Bytes read ahead of the 
+ * last frame are given back to seekable streams; the file itself is left 
+ * open.
+ */
+void pnm_frames_close(pnm_frames *frames)
+{
+  if (frames == NULL) {
+    return;
+  }
+  if (frames->in.buf != NULL) {
+    ascii_close(&frames->in);
+  }
+  free(frames->buf);
+  free(frames);
+}
+
+/* pnm_writer_open:
+ * Write the header of a PNM/PAM/PFM image described by *info (pnm_type, 
+ * width, height and maxval; endianess for PFM, 0 meaning host order; depth
+ * and tupltype for PAM) to f and set up *writer for writing its raster 
+ * incrementally from buffers of the given sample type. ASCII PBM/PGM lines 
+ * hold PNM_LINEVALS samples.
+ */
+int pnm_writer_open(pnm_writer **writer, FILE *f, int sample_type,
+  const pnm_info *info)
+{
+  pnm_writer *w;
+  int err;
+
+  *writer = NULL;
+  if ((err = writer_check(sample_type, info)) != PNM_OK) {
+    return err;
+  }
+  if ((w = malloc(sizeof(*w))) == NULL) {
+    return PNM_ERR_NOMEM;
+  }
+  if ((err = writer_init(w, f, sample_type, info, PNM_LINEVALS)) != PNM_OK) {
+    free(w);
+    return err;
+  }
+  *writer = w;
+  return PNM_OK;
+}
+
+/* pnm_write_rows:
+ * Write the next nrows rows from buf. 
+ * Returns the number of rows written, or PNM_ERR_RANGE if that would exceed
+ * the height of the image.
+ */
+int pnm_write_rows(pnm_writer *writer, const void *buf, int nrows)
+{
+  return pnm_write_rows_strided(writer, buf, 0, nrows);
+}
+
+/* pnm_write_rows_strided:
+ * Same as pnm_write_rows for rows that start stride bytes apart in buf (0 
+ * for packed rows). Padding bytes past the end of each row are not read.
+ * Returns PNM_ERR_RANGE as well if stride is shorter than a row.
+ */
+int pnm_write_rows_strided(pnm_writer *writer, const void *buf, size_t stride,
+  int nrows)
+{
+  if ((nrows < 0) || (nrows > writer->info.height - writer->row) ||
+      ((stride != 0) && (stride < writer->row_size))) {
+    return PNM_ERR_RANGE;
+  }
+  writer_put_rows(writer, buf, stride, nrows);
+  return nrows;
+}
+
+/* pnm_writer_close:
+ * Flush and release a writer. The file itself is left open.
+ * Returns PNM_OK, PNM_ERR_FORMAT if fewer rows than the height of the image
+ * were written, or PNM_ERR_IO if a write failed.
+ */
+int pnm_writer_close(pnm_writer *writer)
+{
+  int err = PNM_OK;
+
+  if (writer == NULL) {
+    return PNM_OK;
+  }
+  writer_finish(writer);
+  if (writer->row < writer->info.height) {
+    err = PNM_ERR_FORMAT;
+  } else if (ferror(writer->f)) {
+    err = PNM_ERR_IO;
+  }
+  free(writer);
+  return err;
+}
+
+/* pnm_ctx_read_data:
+ * Read the whole raster of an image, whose header has been read into info,
+ * into buf as the given sample type (see pnm_reader_open). 
+ */
+int pnm_ctx_read_data(pnm_ctx *ctx, FILE *f, const pnm_info *info, 
+  void *buf, int sample_type)
+{
+  return pnm_ctx_read_data_strided(ctx, f, info, buf, 0, sample_type);
+}
+
+/* pnm_ctx_read_data_strided:
+ * Same as pnm_ctx_read_data for rows that start stride bytes apart in buf 
+ * (0 for packed rows); see pnm_read_rows_strided.
+ */
+int pnm_ctx_read_data_strided(pnm_ctx *ctx, FILE *f, const pnm_info *info, 
+  void *buf, size_t stride, int sample_type)
+{
+  pnm_reader r;
+  int err;
+
+  if ((err = reader_init(&r, f, sample_type, info)) != PNM_OK) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Cannot read %s data: %s", 
+      hdr_magic(info->pnm_type), pnm_strerror(err));
+    return ctx_fail(ctx, err);
+  }
+  err = pnm_read_rows_strided(&r, buf, stride, info->height);
+  reader_finish(&r);
+  if (err == PNM_ERR_RANGE) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Row stride %lu is too short!", 
+      (unsigned long)stride);
+    return ctx_fail(ctx, err);
+  } else if (err < 0) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Image data truncated after %d of %d rows!",
+      r.row, info->height);
+    return ctx_fail(ctx, err);
+  }
+  return PNM_OK;
+}
+
+/* pnm_ctx_write:
+ * Write an image described by info (see pnm_writer_open), header included,
+ * from buf, which holds all of its rows as the given sample type.
+ */
+int pnm_ctx_write(pnm_ctx *ctx, FILE *f, const pnm_info *info, 
+  const void *buf, int sample_type)
+{
+  return pnm_ctx_write_strided(ctx, f, info, buf, 0, sample_type);
+}
+
+/* pnm_ctx_write_strided:
+ * Same as pnm_ctx_write for rows that start stride bytes apart in buf (0 
+ * for packed rows); see pnm_write_rows_strided.
+ */
+int pnm_ctx_write_strided(pnm_ctx *ctx, FILE *f, const pnm_info *info, 
+  const void *buf, size_t stride, int sample_type)
+{
+  pnm_writer w;
+  int err;
+
+  if (((err = writer_check(sample_type, info)) == PNM_OK) && (stride != 0) &&
+      (stride < (size_t)info->width * info_depth(info) * 
+                pnm_sample_size(sample_type))) {
+    err = PNM_ERR_RANGE;
+  }
+  if ((err != PNM_OK) ||
+      ((err = writer_init(&w, f, sample_type, info, PNM_LINEVALS)) != PNM_OK)) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Cannot write image: %s", pnm_strerror(err));
+    return ctx_fail(ctx, err);
+  }
+  writer_put_rows(&w, buf, stride, info->height);
+  writer_finish(&w);
+  if (ferror(f)) {
+    ctx_log(ctx, PNM_LOG_ERROR, "Write error!");
+    return ctx_fail(ctx, PNM_ERR_IO);
+  }
+  return PNM_OK;
+}
+
+/* pnm_map:
+ * Map a binary PBM/PGM/PPM (P4/P5/P6) or PFM (PF/Pf) file into memory and 
+ * describe its raster in place; no pixel data are copied or allocated.
+ * Returns PNM_OK or a negative error code. ASCII formats cannot be mapped
+ * (PNM_ERR_UNSUPPORTED).
+ */
+int pnm_map(const char *file_name, pnm_view *view)
+{
+#if defined(_WIN32)
+  (void)file_name;
+  (void)view;
+  return PNM_ERR_UNSUPPORTED;
+#else
+  int fd, err;
+  struct stat st;
+  void *base;
+  hdr_src s;
+  hdr_info h;
+  size_t hdr_bytes, bps;
+
+  if ((fd = open(file_name, O_RDONLY)) < 0) {
+    return PNM_ERR_IO;
+  }
+  if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+    close(fd);
+    return PNM_ERR_IO;
+  }
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return PNM_ERR_IO;
+  }
+
+  s.f   = NULL;
+  s.p   = (const unsigned char *)base;
+  s.end = s.p + st.st_size;
+  s.from_file = 0;
+  s.ncalls = 0;
+  s.nbytes = 0;
+  if ((err = hdr_parse(&s, &h)) != PNM_OK) {
+    munmap(base, (size_t)st.st_size);
+    return err;
+  }
+
+  view->pnm_type  = h.pnm_type;
+  view->width     = h.xdim;
+  view->height    = h.ydim;
+  view->depth     = h.depth;
+  view->maxval    = h.maxval;
+  view->endianess = 0;
+  if (h.pnm_type == PFM_RGB || h.pnm_type == PFM_GREYSCALE) {
+    view->endianess = (h.scale > 0.0) ? 1 : -1;
+  }
+  strcpy(view->tupltype, h.tupltype);
+  bps = (h.maxval > 255) ? 2 : 1;
+  switch (h.pnm_type) {
+    case PBM_BINARY:
+      view->stride = ((size_t)h.xdim + 7) / 8;
+      break;
+    case PGM_BINARY: case PPM_BINARY: case PAM:
+      view->stride = (size_t)h.xdim * h.depth * bps;
+      break;
+    case PFM_RGB: case PFM_GREYSCALE:
+      view->stride = (size_t)h.xdim * h.depth * sizeof(float);
+      break;
+    default:
+      munmap(base, (size_t)st.st_size);
+      return PNM_ERR_UNSUPPORTED;
+  }
+
+  /* The raster must be entirely contained in the file. */
+  hdr_bytes = (size_t)(s.p - (const unsigned char *)base);
+  if (((size_t)h.ydim > ((size_t)st.st_size - hdr_bytes) / view->stride)) {
+    munmap(base, (size_t)st.st_size);
+    return PNM_ERR_FORMAT;
+  }
+  view->data       = s.p;
+  view->size       = view->stride * h.ydim;
+  view->map_base   = base;
+  view->map_length = (size_t)st.st_size;
+  return PNM_OK;
+#endif
+}
 
-  /* NOTE: This part can be written more succinctly, however, 
-   * it is better to have the PNM types decoded explicitly.
-   */
-  if (strcmp(magic, "P1") == 0) {
-    pnm_type = PBM_ASCII;
-  } else if (strcmp(magic, "P2") == 0) {
-    pnm_type = PGM_ASCII;
-  } else if (strcmp(magic, "P3") == 0) {
-    pnm_type = PPM_ASCII;
-  } else if (strcmp(magic, "P4") == 0) {
-    pnm_type = PBM_BINARY;
-  } else if (strcmp(magic, "P5") == 0) {
-    pnm_type = PGM_BINARY;
-  } else if (strcmp(magic, "P6") == 0) {
-    pnm_type = PPM_BINARY;
-  } else if (strcmp(magic, "P7") == 0) {
-    pnm_type = PAM;
-  } else if (strcmp(magic, "PF") == 0) {
-    pnm_type = PFM_RGB;
-  } else if (strcmp(magic, "Pf") == 0) {
-    pnm_type = PFM_GREYSCALE;
-  } else {
-    fprintf(stderr, "Error: Unknown PNM/PFM file; wrong magic number!\n");
-    exit(1);
+/* pnm_unmap:
+ * Release a view obtained with pnm_map.
+ */
+void pnm_unmap(pnm_view *view)
+{
+#if !defined(_WIN32)
+  if (view->map_base != NULL) {
+    munmap(view->map_base, view->map_length);
   }
+#endif
+  view->map_base   = NULL;
+  view->map_length = 0;
+  view->data       = NULL;
+}
 
-  return (pnm_type);
+/* Batch read-ahead state. An I/O thread opens the files in order, up to 
+ * depth files ahead of the caller, and starts reading each of them.
+ */
+struct pnm_batch {
+  const char * const *names;
+  int nfiles, depth;
+  int next;                 /* next file to hand out */
+  FILE **files;             /* ring of depth opened files */
+#if !defined(_WIN32)
+  int threaded;             /* the I/O thread is running */
+  int opened;               /* files opened so far */
+  int stop;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+
+/* batch_open_file:
+ * Open a file of a batch and have its first block read, so that the read 
+ * of its header does not block. The kernel is also told that the whole 
+ * file will be needed, so that it reads it ahead.
+ */
+static FILE *batch_open_file(const char *name)
+{
+  FILE *f;
+  int c;
+
+  if ((f = fopen(name, "rb")) == NULL) {
+    return NULL;
+  }
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fileno(f), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  if ((c = getc(f)) != EOF) {
+    ungetc(c, f);
+  }
+  return f;
 }
 
-/* read_pbm_header:
- * Read the header contents of a PBM (Portable Binary Map) file.
- * Returns the number of bytes that need be allocated for the image data.
- * An ASCII PBM image file follows the format:
- * P1
- * <X> <Y>
- * <I1> <I2> ... <IMAX>
- * A binary PBM image file uses P4 instead of P1 and 
- * the data values are represented in binary. 
- * NOTE1: Comment lines start with '#'.
- * NOTE2: < > denote integer values (in decimal).
+#if !defined(_WIN32)
+/* batch_io_thread:
+ * Open the files of a batch ahead of the caller.
  */
-int read_pbm_header(FILE *f, int *img_xdim, int *img_ydim, int *is_ascii)
+static void *batch_io_thread(void *arg)
 {
-  int x_val, y_val;
-  unsigned int i;
-  char magic[MAXLINE];
-  char line[MAXLINE];
-  int count=0;
+  pnm_batch *b = arg;
+  FILE *f;
+  int i;
 
-  /* Read the PBM file header. */
-  while (fgets(line, MAXLINE, f) != NULL) {
-    int flag = 0;
-    for (i = 0; i < strlen(line); i++) {
-      if (isgraph(line[i])) {
-        if ((line[i] == '#') && (flag == 0)) {
-          flag = 1;
-        }
-      }
-    }
-    if (flag == 0) {
-      if (count == 0) {
-        count += sscanf(line, "%2s %d %d", magic, &x_val, &y_val);
-      } else if (count == 1) {
-        count += sscanf(line, "%d %d", &x_val, &y_val);
-      } else if (count == 2) {
-        count += sscanf(line, "%d", &y_val);
-      }
-    }
-    if (count == 3) {
-      break;
+  pthread_mutex_lock(&b->lock);
+  while ((b->opened < b->nfiles) && !b->stop) {
+    if (b->opened >= b->next + b->depth) {
+      pthread_cond_wait(&b->cond, &b->lock);
+      continue;
     }
+    i = b->opened;
+    pthread_mutex_unlock(&b->lock);
+    f = batch_open_file(b->names[i]);
+    pthread_mutex_lock(&b->lock);
+    b->files[i % b->depth] = f;
+    b->opened++;
+    pthread_cond_broadcast(&b->cond);
   }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+#endif
 
-  if (strcmp(magic, "P1") == 0) {
-    *is_ascii = 1;
-  } else if (strcmp(magic, "P4") == 0) {
-    *is_ascii = 0;
-  } else {
-    fprintf(stderr, "Error: Input file not in PBM format!\n");
-    exit(1);
+/* pnm_batch_open:
+ * Set up *batch for reading the nfiles files named in names, in order, with 
+ * up to depth of them opened and read ahead on an I/O thread. The names 
+ * must remain valid until pnm_batch_close.
+ */
+int pnm_batch_open(pnm_batch **batch, const char * const *names, int nfiles,
+  int depth)
+{
+  pnm_batch *b;
+
+  *batch = NULL;
+  if ((nfiles < 0) || (depth < 1)) {
+    return PNM_ERR_RANGE;
+  }
+  if ((b = malloc(sizeof(pnm_batch))) == NULL) {
+    return PNM_ERR_NOMEM;
+  }
+  b->names  = names;
+  b->nfiles = nfiles;
+  b->depth  = depth;
+  b->next   = 0;
+  if ((b->files = calloc(depth, sizeof(FILE *))) == NULL) {
+    free(b);
+    return PNM_ERR_NOMEM;
   }
+#if !defined(_WIN32)
+  b->opened = 0;
+  b->stop   = 0;
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->cond, NULL);
+  /* Without the I/O thread, files are opened on demand. */
+  b->threaded = (pthread_create(&b->tid, NULL, batch_io_thread, b) == 0);
+#endif
+  *batch = b;
+  return PNM_OK;
+}
 
-  fprintf(stderr, "Info: magic=%s, x_val=%d, y_val=%d\n",
-    magic, x_val, y_val);
-  *img_xdim   = x_val;
-  *img_ydim   = y_val;
+/* pnm_batch_next:
+ * Hand out the next file of a batch in *f, opened in binary mode and 
+ * positioned at its start, ready for pnm_read_header or get_pnm_type and 
+ * the read_* functions. The caller closes it with fclose. Returns 1, 
+ * PNM_ERR_IO (with *f set to NULL) if the file could not be opened, or 0 
+ * once all files have been handed out.
+ */
+int pnm_batch_next(pnm_batch *batch, FILE **f)
+{
+  pnm_batch *b = batch;
+  int i = b->next;
 
-  return *img_xdim * *img_ydim * sizeof(int);
+  *f = NULL;
+  if (i >= b->nfiles) {
+    return 0;
+  }
+#if !defined(_WIN32)
+  if (b->threaded) {
+    pthread_mutex_lock(&b->lock);
+    while (b->opened <= i) {
+      pthread_cond_wait(&b->cond, &b->lock);
+    }
+    *f = b->files[i % b->depth];
+    b->files[i % b->depth] = NULL;
+    b->next++;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    return (*f != NULL) ? 1 : PNM_ERR_IO;
+  }
+#endif
+  *f = batch_open_file(b->names[i]);
+  b->next++;
+  return (*f != NULL) ? 1 : PNM_ERR_IO;
 }
 
-/* read_pgm_header:
- * Read the header contents of a PGM (Portable Grey[scale] Map) file.
- * Returns the number of bytes that need be allocated for the image data.
- * An ASCII PGM image file follows the format:
- * P2
- * <X> <Y> 
- * <levels>
- * <I1> <I2> ... <IMAX>
- * A binary PGM image file uses P5 instead of P2 and 
- * the data values are represented in binary. 
- * NOTE1: Comment lines start with '#'.
- * NOTE2: < > denote integer values (in decimal).
+/* pnm_batch_name:
+ * Return the name of the file last handed out by pnm_batch_next, or NULL.
  */
-int read_pgm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors, int *is_ascii)
+const char *pnm_batch_name(const pnm_batch *batch)
 {
-  int x_val, y_val, maxcolors_val;
-  unsigned int i;
-  char magic[MAXLINE];
-  char line[MAXLINE];
-  int count=0;
+  return (batch->next > 0) ? batch->names[batch->next - 1] : NULL;
+}
 
-  /* Read the PGM file header. */
-  while (fgets(line, MAXLINE, f) != NULL) {   
-    int flag = 0;
-    for (i = 0; i < strlen(line); i++) {
-      if (isgraph(line[i]) && (flag == 0)) {
-        if ((line[i] == '#') && (flag == 0)) {
-          flag = 1;
-        }
-      }
-    }
-    if (flag == 0) {
-      if (count == 0) {
-        count += sscanf(line, "%2s %d %d %d", magic, &x_val, &y_val, &maxcolors_val);
-      } else if (count == 1) {
-        count += sscanf(line, "%d %d %d", &x_val, &y_val, &maxcolors_val);
-      } else if (count == 2) {
-        count += sscanf(line, "%d %d", &y_val, &maxcolors_val);
-      } else if (count == 3) {
-        count += sscanf(line, "%d", &maxcolors_val);
-      }
-    }
-    if (count == 4) {
-      break;
+/* pnm_batch_close:
+ * Stop reading ahead, close the files that have not been handed out, and 
+ * release a batch.
+ */
+void pnm_batch_close(pnm_batch *batch)
+{
+  int i;
+
+  if (batch == NULL) {
+    return;
+  }
+#if !defined(_WIN32)
+  if (batch->threaded) {
+    pthread_mutex_lock(&batch->lock);
+    batch->stop = 1;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    pthread_join(batch->tid, NULL);
+  }
+  pthread_cond_destroy(&batch->cond);
+  pthread_mutex_destroy(&batch->lock);
+#endif
+  for (i = 0; i < batch->depth; i++) {
+    if (batch->files[i] != NULL) {
+      fclose(batch->files[i]);
     }
   }
+  free(batch->files);
+  free(batch);
+}
 
-  if (strcmp(magic, "P2") == 0) {
-    *is_ascii = 1;
-  } else if (strcmp(magic, "P5") == 0) {
-    *is_ascii = 0;
-  } else {
-    fprintf(stderr, "Error: Input file not in PGM format!\n");
-    exit(1);
-  }
+/* Frame buffer pool state. Buffers are kept on a list, most recently used
+ * first, and handed out again for images of the same geometry and sample 
+ * type. 
+ */
+typedef struct pool_buf {
+  void *buf;
+  size_t stride;
+  int width, height, depth, sample_type;
+  int in_use;
+  struct pool_buf *next;
+} pool_buf;
 
-  fprintf(stderr, "Info: magic=%s, x_val=%d, y_val=%d, maxcolors_val=%d\n",
-    magic, x_val, y_val, maxcolors_val);
-  *img_xdim   = x_val;
-  *img_ydim   = y_val;
-  *img_colors = maxcolors_val;
+struct pnm_pool {
+  pool_buf *bufs;
+  int max_idle;             /* idle buffers kept */
+  int idle;                 /* idle buffers on the list */
+#if !defined(_WIN32)
+  pthread_mutex_t lock;
+#endif
+};
 
-  return *img_xdim * *img_ydim * sizeof(int);
+/* pool_lock:
+ * Lock a pool against other threads.
+ */
+static void pool_lock(pnm_pool *pool)
+{
+#if !defined(_WIN32)
+  pthread_mutex_lock(&pool->lock);
+#else
+  (void)pool;
+#endif
 }
 
-/* read_ppm_header:
- * Read the header contents of a PPM (Portable Pix[el] Map) file.
- * Returns the number of bytes that need be allocated for the image data.
- * An ASCII PPM image file follows the format:
- * P3
- * <X> <Y> 
- * <colors>
- * <R1> <G1> <B1> ... <RMAX> <GMAX> <BMAX>
- * A binary PPM image file uses P6 instead of P3 and 
- * the data values are represented in binary. 
- * NOTE1: Comment lines start with '#'.
- # NOTE2: < > denote integer values (in decimal).
+/* pool_unlock:
+ * Unlock a pool locked by pool_lock.
  */
-int read_ppm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors, int *is_ascii)
+static void pool_unlock(pnm_pool *pool)
 {
-  int x_val, y_val, maxcolors_val;
-  unsigned int i;
-  char magic[MAXLINE];
-  char line[MAXLINE];
-  int count=0;
- 
-  /* Read the PPM file header. */
-  while (fgets(line, MAXLINE, f) != NULL) {
-    int flag = 0;
-    for (i = 0; i < strlen(line); i++) {
-      if (isgraph(line[i]) && (flag == 0)) {
-        if ((line[i] == '#') && (flag == 0)) {
-          flag = 1;
-        }
-      }
-    }
-    if (flag == 0) {
-      if (count == 0) {
-        count += sscanf(line, "%2s %d %d %d", magic, &x_val, &y_val, &maxcolors_val);
-      } else if (count == 1) {
-        count += sscanf(line, "%d %d %d", &x_val, &y_val, &maxcolors_val);
-      } else if (count == 2) {
-        count += sscanf(line, "%d %d", &y_val, &maxcolors_val);
-      } else if (count == 3) {
-        count += sscanf(line, "%d", &maxcolors_val);
-      }
-    }
-    if (count == 4) {
-      break;
-    }
-  }
+#if !defined(_WIN32)
+  pthread_mutex_unlock(&pool->lock);
+#else
+  (void)pool;
+#endif
+}
 
-  if (strcmp(magic, "P3") == 0) {
-    *is_ascii = 1;
-  } else if (strcmp(magic, "P6") == 0) {
-    *is_ascii = 0;
-  } else {
-    fprintf(stderr, "Error: Input file not in PPM format!\n");
-    exit(1);
+/* pnm_pool_open:
+ * Set up a pool of frame buffers, which keeps up to max_idle buffers that 
+ * are not in use for later requests. The pool may be shared by threads.
+ */
+int pnm_pool_open(pnm_pool **pool, int max_idle)
+{
+  pnm_pool *p;
+
+  *pool = NULL;
+  if (max_idle < 0) {
+    return PNM_ERR_RANGE;
+  }
+  if ((p = malloc(sizeof(pnm_pool))) == NULL) {
+    return PNM_ERR_NOMEM;
   }
+  p->bufs     = NULL;
+  p->max_idle = max_idle;
+  p->idle     = 0;
+#if !defined(_WIN32)
+  pthread_mutex_init(&p->lock, NULL);
+#endif
+  *pool = p;
+  return PNM_OK;
+}
+
+/* pnm_pool_get:
+ * Return a buffer for the raster of an image described by info, with 
+ * samples of the given type, laid out as by pnm_image_alloc; the row stride
+ * is stored in *stride. An idle buffer of the same geometry and sample type
+ * is reused if there is one. New buffers are cleared in full, so that all 
+ * their pages are faulted in before they are first used. Returns NULL if 
+ * the image is empty or too large, or if memory runs out.
+ */
+void *pnm_pool_get(pnm_pool *pool, const pnm_info *info, int sample_type, 
+  size_t *stride)
+{
+  int depth = info_depth(info);
+  pool_buf *b;
 
-  fprintf(stderr, "Info: magic=%s, x_val=%d, y_val=%d, maxcolors_val=%d\n",
-    magic, x_val, y_val, maxcolors_val);
-  *img_xdim   = x_val;
-  *img_ydim   = y_val;
-  *img_colors = maxcolors_val;
+  pool_lock(pool);
+  for (b = pool->bufs; b != NULL; b = b->next) {
+    if (!b->in_use && (b->width == info->width) && 
+        (b->height == info->height) && (b->depth == depth) && 
+        (b->sample_type == sample_type)) {
+      b->in_use = 1;
+      pool->idle--;
+      pool_unlock(pool);
+      *stride = b->stride;
+      return b->buf;
+    }
+  }
+  pool_unlock(pool);
 
-  return 3 * *img_xdim * *img_ydim * sizeof(int);
+  if ((b = malloc(sizeof(pool_buf))) == NULL) {
+    *stride = 0;
+    return NULL;
+  }
+  if ((b->buf = pnm_image_alloc(info, sample_type, &b->stride)) == NULL) {
+    free(b);
+    *stride = 0;
+    return NULL;
+  }
+  memset(b->buf, 0, (size_t)info->height * b->stride);
+  b->width       = info->width;
+  b->height      = info->height;
+  b->depth       = depth;
+  b->sample_type = sample_type;
+  b->in_use      = 1;
+  pool_lock(pool);
+  b->next    = pool->bufs;
+  pool->bufs = b;
+  pool_unlock(pool);
+  *stride = b->stride;
+  return b->buf;
 }
 
-/* read_pfm_header:
- * Read the header contents of a PFM (portable float map) file.
- * Returns the number of bytes that need be allocated for the image data.
- * A PFM image file follows the format:
- * [PF|Pf]
- * <X> <Y> 
- * (endianess)
- * {R1}{G1}{B1} ... {RMAX}{GMAX}{BMAX} 
- * NOTE1: Comment lines, if allowed, start with '#'.
- # NOTE2: < > denote integer values (in decimal).
- # NOTE3: ( ) denote floating-point values (in decimal).
- # NOTE4: { } denote floating-point values (coded in binary).
+/* pnm_pool_put:
+ * Give a buffer from pnm_pool_get back to the pool. If more than max_idle 
+ * buffers are then idle, the least recently used idle buffer is released.
  */
-int read_pfm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_type, int *endianess)
+void pnm_pool_put(pnm_pool *pool, void *buf)
 {
-  int x_val, y_val;
-  unsigned int i;
-  int is_rgb=0, is_greyscale=0;
-  float aspect_ratio=0;
-  char magic[MAXLINE];
-  char line[MAXLINE];
-  int count=0;
-  int num_bytes=0;
+  pool_buf *b, *prev = NULL, *lru = NULL, *lru_prev = NULL;
 
-  /* Read the PFM file header. */
-  while (fgets(line, MAXLINE, f) != NULL) {
-    int flag = 0;
-    for (i = 0; i < strlen(line); i++) {
-      if (isgraph(line[i]) && (flag == 0)) {
-        if ((line[i] == '#') && (flag == 0)) {
-          flag = 1;
-        }
-      }
-    }
-    if (flag == 0) {
-      if (count == 0) {
-        count += sscanf(line, "%2s %d %d %f", magic, &x_val, &y_val, &aspect_ratio);
-      } else if (count == 1) {
-        count += sscanf(line, "%d %d %f", &x_val, &y_val, &aspect_ratio);
-      } else if (count == 2) {
-        count += sscanf(line, "%d %f", &y_val, &aspect_ratio);
-      } else if (count == 3) {
-        count += sscanf(line, "%f", &aspect_ratio);
+  if (buf == NULL) {
+    return;
+  }
+  pool_lock(pool);
+  for (b = pool->bufs; (b != NULL) && (b->buf != buf); b = b->next) {
+    prev = b;
+  }
+  if ((b == NULL) || !b->in_use) {
+    pool_unlock(pool);
+    return;
+  }
+  /* Move the buffer to the front of the list. */
+  b->in_use = 0;
+  pool->idle++;
+  if (prev != NULL) {
+    prev->next = b->next;
+    b->next    = pool->bufs;
+    pool->bufs = b;
+  }
+  if (pool->idle > pool->max_idle) {
+    for (prev = NULL, b = pool->bufs; b != NULL; prev = b, b = b->next) {
+      if (!b->in_use) {
+        lru      = b;
+        lru_prev = prev;
       }
     }
-    if (count == 4) {
-      break;
+    if (lru_prev != NULL) {
+      lru_prev->next = lru->next;
+    } else {
+      pool->bufs = lru->next;
     }
+    pool->idle--;
   }
+  pool_unlock(pool);
+  if (lru != NULL) {
+    pnm_image_free(lru->buf);
+    free(lru);
+  }
+}
 
-  if (strcmp(magic, "PF") == 0) {
-    is_rgb       = 1;
-    is_greyscale = 0;
-  } else if (strcmp(magic, "Pf") == 0) {
-    is_greyscale = 0;
-    is_rgb       = 1;    
-  } else {
-    fprintf(stderr, "Error: Input file not in PFM format!\n");
-    exit(1);
-  }      
-
-  fprintf(stderr, "Info: magic=%s, x_val=%d, y_val=%d, aspect_ratio=%f\n",
-    magic, x_val, y_val, aspect_ratio);
+/* pnm_pool_read:
+ * Read the whole raster of an image, whose header has been read into info,
+ * into a buffer from pnm_pool_get, as the given sample type (see 
+ * pnm_reader_open). The buffer is stored in *buf and its row stride in 
+ * *stride; it is to be given back with pnm_pool_put. Returns PNM_OK or a 
+ * negative error code, in which case no buffer is kept.
+ */
+int pnm_pool_read(pnm_pool *pool, FILE *f, const pnm_info *info, 
+  int sample_type, void **buf, size_t *stride)
+{
+  pnm_ctx ctx;
+  int err;
 
-  /* FIXME: Aspect ratio different to 1.0 is not yet supported. */
-  if (!floatEqualComparison(aspect_ratio, -1.0, 1E-06) &&
-      !floatEqualComparison(aspect_ratio, 1.0, 1E-06)) {
-    fprintf(stderr, "Error: Aspect ratio different to -1.0 or +1.0 is unsupported!\n");
-    exit(1);
+  if ((*buf = pnm_pool_get(pool, info, sample_type, stride)) == NULL) {
+    return image_fits(info->width, info->height, info_depth(info)) ? 
+      PNM_ERR_NOMEM : PNM_ERR_RANGE;
   }
-
-  *img_xdim   = x_val;
-  *img_ydim   = y_val;
-  *img_type   = is_rgb & ~is_greyscale;
-  if (aspect_ratio > 0.0) {
-    *endianess = 1;
-  } else {
-    *endianess = -1;
+  pnm_ctx_init(&ctx);
+  if ((err = pnm_ctx_read_data_strided(&ctx, f, info, *buf, *stride, 
+         sample_type)) != PNM_OK) {
+    pnm_pool_put(pool, *buf);
+    *buf = NULL;
   }
+  return err;
+}
+
+/* pnm_pool_close:
+ * Release a pool and all of its buffers, which must not be in use any 
+ * more.
+ */
+void pnm_pool_close(pnm_pool *pool)
+{
+  pool_buf *b, *next;
 
-  num_bytes = *img_xdim * *img_ydim * sizeof(float);
-  if (is_rgb) {
-    num_bytes *= 3;
+  if (pool == NULL) {
+    return;
+  }
+  for (b = pool->bufs; b != NULL; b = next) {
+    next = b->next;
+    pnm_image_free(b->buf);
+    free(b);
   }
-  return num_bytes;
+#if !defined(_WIN32)
+  pthread_mutex_destroy(&pool->lock);
+#endif
+  free(pool);
 }
 
-/* read_pbm_data:
- * Read the data contents of a PBM (portable bit map) file.
+/* tone_table:
+ * Fill a tone curve table (see PNM_TONE_BASE) with x^(1/gamma), or with 
+ * the sRGB curve if gamma is 0 or less, scaled to maxval.
  */
-void read_pbm_data(FILE *f, int *img_in, int is_ascii)
+static void tone_table(float *lut, float gamma, int maxval)
 {
-  int i=0, c;
-  int lum_val;
+  uint32_t b;
+  double y;
+  float x;
   int k;
-  
-  /* Read the rest of the PBM file. */
-  while ((c = fgetc(f)) != EOF) {
-    ungetc(c, f);
-    if (is_ascii == 1) {
-      if (fscanf(f, "%d", &lum_val) != 1) return;
-      img_in[i++] = lum_val;
+
+  for (k = 0; k < PNM_TONE_ENTRIES - 1; k++) {
+    b = PNM_TONE_BASE + ((uint32_t)k << 16);
+    memcpy(&x, &b, sizeof(x));
+    if (gamma > 0.0f) {
+      y = pow(x, 1.0 / gamma);
+    } else if (x <= 0.0031308f) {
+      y = 12.92 * x;
     } else {
-      lum_val = fgetc(f);
-      /* Decode the image contents byte-by-byte. */
-      for (k = 0; k < 8; k++) {
-        img_in[i++] = (lum_val >> (7-k)) & 0x1;
-      }        
+      y = 1.055 * pow(x, 1.0 / 2.4) - 0.055;
     }
-  } 
+    y *= maxval;
+    lut[k] = (float)((y < maxval) ? y : maxval);
+  }
+  lut[k] = lut[k-1];
 }
 
-/* read_pgm_data:
- * Read the data contents of a PGM (portable grey map) file.
+/* tone_check:
+ * Check the parameters of a tone mapping to the given sample type.
  */
-void read_pgm_data(FILE *f, int *img_in, int is_ascii)
+static int tone_check(int sample_type, float exposure, float gamma, 
+  int maxval)
 {
-  int i=0, c;
-  int lum_val;
-  
-  /* Read the rest of the PGM file. */
-  while ((c = fgetc(f)) != EOF) {
-    ungetc(c, f);
-    if (is_ascii == 1) {
-        if (fscanf(f, "%d", &lum_val) != 1) return;
-	  } else {
-      lum_val = fgetc(f);
-    }        
-    img_in[i++] = lum_val;
-  } 
+  if ((sample_type != PNM_SAMPLE_U8) && (sample_type != PNM_SAMPLE_U16)) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if (!isfinite(exposure) || !isfinite(gamma) || (maxval < 1) || 
+      (maxval > ((sample_type == PNM_SAMPLE_U8) ? 255 : 65535))) {
+    return PNM_ERR_RANGE;
+  }
+  return PNM_OK;
 }
 
-/* read_ppm_data:
- * Read the data contents of a PPM (portable pix map) file.
+/* tone_span:
+ * Tone map n samples from src to dst, of the given sample type.
  */
-void read_ppm_data(FILE *f, int *img_in, int is_ascii)
+static void tone_span(void *dst, int sample_type, const float *src, size_t n,
+  float scale, const float *lut)
 {
-  int i=0, c;
-  int r_val, g_val, b_val;
-    
-  /* Read the rest of the PPM file. */
-  while ((c = fgetc(f)) != EOF) {
-    ungetc(c, f);
-    if (is_ascii == 1) {
-      if (fscanf(f, "%d %d %d", &r_val, &g_val, &b_val) != 3) return;
-    } else {
-      r_val = fgetc(f);
-      g_val = fgetc(f);
-      b_val = fgetc(f);
-    }
-    img_in[i++] = r_val;
-    img_in[i++] = g_val;
-    img_in[i++] = b_val;
+  if (sample_type == PNM_SAMPLE_U8) {
+    pnm_simd_tonemap_u8((unsigned char *)dst, src, n, scale, lut);
+  } else {
+    pnm_simd_tonemap_u16((uint16_t *)dst, src, n, scale, lut);
   }
 }
 
-/* read_pfm_data:
- * Read the data contents of a PFM (portable float map) file.
+/* pnm_tonemap:
+ * Tone map n float samples, such as those of a PFM raster in host byte 
+ * order, to 8-bit (PNM_SAMPLE_U8) or 16-bit (PNM_SAMPLE_U16) samples of dst 
+ * ranging from 0 to maxval. Samples are scaled by 2^exposure, clamped to 
+ * [0, 1] and mapped through x^(1/gamma), or through the sRGB curve if gamma
+ * is 0 or less. Returns PNM_OK, PNM_ERR_UNSUPPORTED or PNM_ERR_RANGE.
  */
-void read_pfm_data(FILE *f, float *img_in, int img_type, int endianess)
+int pnm_tonemap(void *dst, int sample_type, const float *src, size_t n,
+  float exposure, float gamma, int maxval)
 {
-  int i=0, c;
-  int swap = (endianess == 1) ? 0 : 1;
-  float r_val, g_val, b_val;
-    
-  /* Read the rest of the PFM file. */
-  while ((c = fgetc(f)) != EOF) {
-    ungetc(c, f);   
-    /* Read a possibly byte-swapped float. */
-    if (img_type == RGB_TYPE) {
-      ReadFloat(f, &r_val, swap);
-      ReadFloat(f, &g_val, swap);
-      ReadFloat(f, &b_val, swap); 
-      img_in[i++] = r_val;
-      img_in[i++] = g_val;
-      img_in[i++] = b_val;
-    } else if (img_type == GREYSCALE_TYPE) {
-      ReadFloat(f, &g_val, swap);
-      img_in[i++] = g_val;
-    }
+  float lut[PNM_TONE_ENTRIES];
+  int err;
+
+  if ((err = tone_check(sample_type, exposure, gamma, maxval)) != PNM_OK) {
+    return err;
   }
+  tone_table(lut, gamma, maxval);
+  tone_span(dst, sample_type, src, n, (float)pow(2.0, exposure), lut);
+  return PNM_OK;
 }
 
-/* write_pbm_file:
- * Write the contents of a PBM (portable bit map) file.
+/* A range of rows of a tone mapping pass, mapped by one thread. */
+typedef struct {
+  float *band;              /* rows of the pass, bottom row first */
+  unsigned char *out;       /* rows of the pass, top row first */
+  int nrows;                /* rows of the pass */
+  int first, last;          /* output rows of this job */
+  size_t row_len;           /* samples per row */
+  int sample_type;
+  int swap;                 /* swap the bytes of each float first */
+  float scale;
+  const float *lut;
+} tone_job;
+
+/* tone_rows:
+ * Tone map the rows of a job, flipping them to top-down order.
  */
-void write_pbm_file(FILE *f, int *img_out,
-  int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals,
-  int is_ascii)
+static void *tone_rows(void *arg)
 {
-  int i, j, x_scaled_size, y_scaled_size;
-  int k, v, temp, step;
- 
-  x_scaled_size = x_size * x_scale_val;
-  y_scaled_size = y_size * y_scale_val; 
-  /* Write the magic number string. */
-  if (is_ascii == 1) {
-    fprintf(f, "P1\n");
-	step = 1;
-  } else {
-    fprintf(f, "P4\n");
-	step = 8;
-  }
-  /* Write the image dimensions. */
-  fprintf(f, "%d %d\n", x_scaled_size, y_scaled_size);
-  
-  /* Write the image data. */
-  for (i = 0; i < y_scaled_size; i++) {
-    for (j = 0; j < x_scaled_size; j+=step) {
-	    if (is_ascii == 1) {
-        fprintf(f, "%d ", img_out[i*x_scaled_size+j]);
-	    } else {
-	      temp = 0;
-		    for (k = 0; k < 8; k++) {
-          v = img_out[i*x_scaled_size+j+k];
-          temp |= (v << (7-k));
-		    }
-        fprintf(f, "%c", temp);
-      }
-      if (((i*x_scaled_size+j) % linevals) == (linevals-1)) {
-        fprintf(f, "\n");
-      }
+  tone_job *j = arg;
+  size_t out_size = j->row_len * pnm_sample_size(j->sample_type);
+  float *src;
+  int r;
+
+  for (r = j->first; r < j->last; r++) {
+    src = j->band + (size_t)(j->nrows - 1 - r) * j->row_len;
+    if (j->swap) {
+      pnm_simd_bswap32(src, src, j->row_len);
     }
-  }   
+    tone_span(j->out + r * out_size, j->sample_type, src, j->row_len, 
+      j->scale, j->lut);
+  }
+  return NULL;
 }
 
-/* write_pgm_file:
- * Write the contents of a PGM (portable grey map) file.
+/* pnm_tonemap_pfm:
+ * Read a PFM image from fin and write it to fout as a binary PPM (PF) or 
+ * PGM (Pf) image with the given maxval, tone mapped as by pnm_tonemap, 
+ * with nthreads threads (0 or less for one per online processor). Samples 
+ * take 16 bits when maxval exceeds 255. The raster is converted in passes 
+ * of a few MB, each written as soon as it is mapped; since PFM rows are 
+ * stored bottom row first, seekable files are read one pass at a time from
+ * their end backwards, while other streams are read whole first. 
+ * Returns PNM_OK or a negative error code.
  */
-void write_pgm_file(FILE *f, int *img_out,
-  int x_size, int y_size, int x_scale_val, int y_scale_val, 
-  int img_colors, int linevals, int is_ascii)
+int pnm_tonemap_pfm(FILE *fin, FILE *fout, float exposure, float gamma, 
+  int maxval, int nthreads)
 {
-  int i, j, x_scaled_size, y_scaled_size;
- 
-  x_scaled_size = x_size * x_scale_val;
-  y_scaled_size = y_size * y_scale_val; 
-  /* Write the magic number string. */
-  if (is_ascii == 1) {
-    fprintf(f, "P2\n");
+  tone_job job[PNM_MAX_THREADS];
+  float lut[PNM_TONE_ENTRIES];
+  pnm_info in, out;
+  pnm_writer w;
+  float *band, *src;
+  unsigned char *dst;
+  stats_slot *st;
+  size_t row_len, row_bytes;
+  file_off start, end = -1;
+  int sample_type = (maxval > 255) ? PNM_SAMPLE_U16 : PNM_SAMPLE_U8;
+  int err, seekable, nb, rows, njobs, y, t;
+
+  if ((err = pnm_read_header(fin, &in)) != PNM_OK) {
+    return err;
+  }
+  if ((in.pnm_type != PFM_RGB) && (in.pnm_type != PFM_GREYSCALE)) {
+    return PNM_ERR_UNSUPPORTED;
+  }
+  if ((err = tone_check(sample_type, exposure, gamma, maxval)) != PNM_OK) {
+    return err;
+  }
+  row_len   = (size_t)in.width * in.depth;
+  row_bytes = row_len * sizeof(float);
+  if ((size_t)in.height > SIZE_MAX / row_bytes) {
+    return PNM_ERR_RANGE;
+  }
+#if !defined(_WIN32)
+  nthreads = pnm_threads(nthreads);
+#else
+  nthreads = 1;
+#endif
+  /* Rows per pass: at least one per thread. */
+  nb = (row_bytes < TONE_BAND) ? (int)(TONE_BAND / row_bytes) : 1;
+  nb = (nb < nthreads) ? nthreads : nb;
+  nb = (nb > in.height) ? in.height : nb;
+
+  start    = FTELL(fin);
+  seekable = (start >= 0) && (FSEEK(fin, 0, SEEK_END) == 0) && 
+             ((end = FTELL(fin)) >= 0);
+  if (seekable) {
+    if ((size_t)(end - start) / row_bytes < (size_t)in.height) {
+      FSEEK(fin, start, SEEK_SET);
+      return PNM_ERR_FORMAT;
+    }
+    band = malloc((size_t)nb * row_bytes);
   } else {
-    fprintf(f, "P5\n");
-  }
-  /* Write the image dimensions. */
-  fprintf(f, "%d %d\n", x_scaled_size, y_scaled_size);
-  /* Write the maximum color/grey level allowed. */
-  fprintf(f, "%d\n", img_colors);
-  
-  /* Write the image data. */
-  for (i = 0; i < y_scaled_size; i++) {
-    for (j = 0; j < x_scaled_size; j++) {
-      if (is_ascii == 1) {
-        fprintf(f, "%d ", img_out[i*x_scaled_size+j]);
-        if (((i*x_scaled_size+j) % linevals) == (linevals-1)) {
-          fprintf(f, "\n");
-        }
-      } else {
-        fprintf(f, "%c", img_out[i*x_scaled_size+j]);
+    band = malloc((size_t)in.height * row_bytes);
+  }
+  dst = malloc((size_t)nb * row_len * pnm_sample_size(sample_type));
+  if ((band == NULL) || (dst == NULL)) {
+    free(band);
+    free(dst);
+    return PNM_ERR_NOMEM;
+  }
+  if (!seekable && 
+      (io_read(band, row_bytes, (size_t)in.height, fin) < (size_t)in.height)) {
+    free(band);
+    free(dst);
+    return PNM_ERR_FORMAT;
+  }
+
+  out.pnm_type    = (in.depth == 3) ? PPM_BINARY : PGM_BINARY;
+  out.width       = in.width;
+  out.height      = in.height;
+  out.depth       = in.depth;
+  out.maxval      = maxval;
+  out.endianess   = 0;
+  out.tupltype[0] = '\0';
+  if ((err = writer_init(&w, fout, sample_type, &out, 0)) != PNM_OK) {
+    free(band);
+    free(dst);
+    return err;
+  }
+  tone_table(lut, gamma, maxval);
+  for (y = 0; y < in.height; y += rows) {
+    rows = (in.height - y < nb) ? in.height - y : nb;
+    st   = stats_begin();
+    if (seekable) {
+      src = band;
+      if ((FSEEK(fin, start + (file_off)((size_t)(in.height - y - rows) * 
+             row_bytes), SEEK_SET) != 0) ||
+          (io_read(band, row_bytes, (size_t)rows, fin) < (size_t)rows)) {
+        stats_end(st, 1, 0);
+        err = PNM_ERR_IO;
+        break;
       }
+    } else {
+      src = band + (size_t)(in.height - y - rows) * row_len;
+    }
+    njobs = (rows < nthreads) ? rows : nthreads;
+    for (t = 0; t < njobs; t++) {
+      job[t].band        = src;
+      job[t].out         = dst;
+      job[t].nrows       = rows;
+      job[t].first       = (int)((long)rows * t / njobs);
+      job[t].last        = (int)((long)rows * (t + 1) / njobs);
+      job[t].row_len     = row_len;
+      job[t].sample_type = sample_type;
+      job[t].swap        = ((in.endianess > 0) == IS_LITTLE_ENDIAN);
+      job[t].scale       = (float)pow(2.0, exposure);
+      job[t].lut         = lut;
     }
-  } 
+#if !defined(_WIN32)
+    run_jobs(tone_rows, job, sizeof(tone_job), njobs);
+#else
+    for (t = 0; t < njobs; t++) {
+      tone_rows(&job[t]);
+    }
+#endif
+    writer_put_rows(&w, dst, 0, rows);
+    stats_end(st, 1, (size_t)rows * row_len);
+  }
+  writer_finish(&w);
+  /* Leave seekable input at the end of the raster. */
+  if (seekable) {
+    FSEEK(fin, start + (file_off)((size_t)in.height * row_bytes), SEEK_SET);
+  }
+  free(band);
+  free(dst);
+  if ((err == PNM_OK) && ferror(fout)) {
+    err = PNM_ERR_IO;
+  }
+  return err;
 }
 
-/* write_ppm_file:
- * Write the contents of a PPM (portable pix map) file.
+/* pnm_stats_enable:
+ * Turn the collection of statistics on (nonzero) or off, for all threads. 
+ * Statistics are off by default, in which case each raster pass and stdio 
+ * call costs a single test.
  */
-void write_ppm_file(FILE *f, int *img_out,
-  int x_size, int y_size, int x_scale_val, int y_scale_val, 
-  int img_colors, int is_ascii)
+void pnm_stats_enable(int on)
 {
-  int i, j, x_scaled_size, y_scaled_size;
-  
-  x_scaled_size = x_size * x_scale_val;
-  y_scaled_size = y_size * y_scale_val;
-  /* Write the magic number string. */
-  if (is_ascii == 1) {
-    fprintf(f, "P3\n");
-  } else {
-    fprintf(f, "P6\n");
-  }
-  /* Write the image dimensions. */
-  fprintf(f, "%d %d\n", x_scaled_size, y_scaled_size);
-  /* Write the maximum color/grey level allowed. */
-  fprintf(f, "%d\n", img_colors);
-  
-  /* Write the image data. */
-  for (i = 0; i < y_scaled_size; i++) {
-    for (j = 0; j < x_scaled_size; j++) {
-      if (is_ascii == 1) {
-        fprintf(f, "%d %d %d ", 
-          img_out[3*(i*x_scaled_size+j)+0], 
-          img_out[3*(i*x_scaled_size+j)+1], 
-          img_out[3*(i*x_scaled_size+j)+2]);
-        if ((j % 4) == 0) {
-          fprintf(f, "\n");
-        }
-      } else {
-        fprintf(f, "%c%c%c", 
-          img_out[3*(i*x_scaled_size+j)+0], 
-          img_out[3*(i*x_scaled_size+j)+1], 
-          img_out[3*(i*x_scaled_size+j)+2]);
-      }
-    }
-  }  
+  STAT_STORE(&stats_on, (on != 0));
 }
 
-/* write_pfm_file:
- * Write the contents of a PFM (portable float map) file.
+/* pnm_stats_get:
+ * Sum the statistics of all threads, since the last pnm_stats_reset, into
+ * *stats. The counters of threads in the middle of a pass are included as
+ * they stand.
  */
-void write_pfm_file(FILE *f, float *img_out,
-  int x_size, int y_size, 
-  int img_type, int endianess)
+void pnm_stats_get(pnm_stats *stats)
 {
-  int i, j, x_scaled_size, y_scaled_size;
-  int swap = (endianess == 1) ? 0 : 1;
-  float fendian = (endianess == 1) ? +1.0 : -1.0;
-  
-  x_scaled_size = x_size;
-  y_scaled_size = y_size;
-
-  /* Write the magic number string. */
-  if (img_type == RGB_TYPE) {
-    fprintf(f, "PF\n");
-  } else if (img_type == GREYSCALE_TYPE) {
-    fprintf(f, "Pf\n");
-  } else {
-    fprintf(stderr, "Error: Image type invalid for PFM format!\n");
-    exit(1);    
+  uint64_t *dst = (uint64_t *)stats, *base = (uint64_t *)&stats_base;
+  size_t k;
+
+#if !defined(_WIN32)
+  pthread_mutex_lock(&stats_lock);
+#endif
+  stats_sum(stats);
+  for (k = 0; k < STAT_FIELDS; k++) {
+    dst[k] -= base[k];
   }
-  /* Write the image dimensions. */
-  fprintf(f, "%d %d\n", x_scaled_size, y_scaled_size);
-  /* Write the endianess/scale factor as float. */
-  fprintf(f, "%f\n", fendian);
-  
-  /* Write the image data. */
-  for (i = 0; i < y_scaled_size; i++) {
-    for (j = 0; j < x_scaled_size; j++) {
-      if (img_type == RGB_TYPE) {
-        WriteFloat(f, &img_out[3*(i*x_scaled_size+j)+0], swap);
-        WriteFloat(f, &img_out[3*(i*x_scaled_size+j)+1], swap);
-        WriteFloat(f, &img_out[3*(i*x_scaled_size+j)+2], swap);
-      } else if (img_type == GREYSCALE_TYPE) {
-        WriteFloat(f, &img_out[i*x_scaled_size+j], swap);
-      }
-    }
-  }  
+#if !defined(_WIN32)
+  pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* pnm_stats_reset:
+ * Start counting the statistics of all threads from zero.
+ */
+void pnm_stats_reset(void)
+{
+#if !defined(_WIN32)
+  pthread_mutex_lock(&stats_lock);
+#endif
+  stats_sum(&stats_base);
+#if !defined(_WIN32)
+  pthread_mutex_unlock(&stats_lock);
+#endif
 }
 
 /* ReadFloat:
@@ -670,18 +4467,13 @@ int ReadFloat(FILE *fptr, float *f, int swap)
  */
 int WriteFloat(FILE *fptr, float *f, int swap)
 {
-  unsigned char *cptr;
+  float val = *f;
 
+  /* Swap a copy, leaving the caller's float untouched. */
   if (swap) {
-    cptr    = (unsigned char*)f;
-    unsigned char tmp = cptr[0];
-    cptr[0] = cptr[3];
-    cptr[3] = tmp;
-    tmp     = cptr[1];
-    cptr[1] = cptr[2];
-    cptr[2] = tmp;
+    pnm_simd_bswap32(&val, f, 1);
   }
-  if (fwrite(f, sizeof(float), 1, fptr) != 1) {
+  if (fwrite(&val, sizeof(float), 1, fptr) != 1) {
     return (FALSE);
   }  
   return (TRUE); 
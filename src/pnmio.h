@@ -24,6 +24,8 @@
 #define PNMIO_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* PNM/PFM image data file format definitions. */
 #define PBM_ASCII         1
@@ -32,11 +34,31 @@
 #define PBM_BINARY        4
 #define PGM_BINARY        5
 #define PPM_BINARY        6
-#define PAM               7 /* reserved */
+#define PAM               7 /* binary only */
                             /* 8-15: reserved */
 #define PFM_RGB          16 /* F */
 #define PFM_GREYSCALE    17 /* f */
 
+/* Sample types of in-memory pixel buffers. */
+#define PNM_SAMPLE_INT         0 /* int, as used by the read_/write_ API */
+#define PNM_SAMPLE_U8          1 /* uint8_t, for maxval up to 255 */
+#define PNM_SAMPLE_U16         2 /* uint16_t, for maxval up to 65535 */
+#define PNM_SAMPLE_FLOAT       3 /* float, as used for PFM */
+
+/* Return codes of the status-returning API functions. */
+#define PNM_OK                 0
+#define PNM_ERR_IO            -1 /* open/read/write/map failure */
+#define PNM_ERR_FORMAT        -2 /* malformed or truncated file */
+#define PNM_ERR_UNSUPPORTED   -3 /* valid file, unsupported variant */
+#define PNM_ERR_RANGE         -4 /* value or size out of range */
+#define PNM_ERR_NOMEM         -5 /* out of memory */
+
+/* Alignment and row padding of pnm_image_alloc buffers, in bytes. */
+#define PNM_ALIGN             64
+
+/* Longest PAM tuple type, terminating NUL included. */
+#define PNM_TUPLTYPE_LEN      64
+
 #define IS_BIGENDIAN(x)   ((*(char*)&x) == 0)
 #define IS_LITTLE_ENDIAN  (1 == *(unsigned char *)&(const int){1})
 #ifndef FALSE
@@ -47,19 +69,111 @@
 #endif
 
 
+/* Zero-copy view of a memory-mapped binary PNM/PAM/PFM file. The raster 
+ * starts at data and consists of height rows of stride bytes each. PBM rows 
+ * are packed 8 pixels per byte (MSB first), PGM/PPM/PAM samples take 2 
+ * bytes (big-endian) when maxval exceeds 255, and PFM rows hold floats in 
+ * the byte order given by endianess, bottom row first. 
+ */
+typedef struct {
+  const unsigned char *data;
+  int    pnm_type;
+  int    width, height;
+  int    depth;      /* samples per pixel */
+  int    maxval;     /* 1 for PBM, 0 for PFM */
+  int    endianess;  /* PFM only: -1 little-endian, +1 big-endian */
+  char   tupltype[PNM_TUPLTYPE_LEN]; /* PAM only, "" if none */
+  size_t stride;     /* bytes per row */
+  size_t size;       /* bytes of raster data */
+  void  *map_base;   /* private */
+  size_t map_length; /* private */
+} pnm_view;
+
+/* Image description used by the incremental API. */
+typedef struct {
+  int pnm_type;
+  int width, height;
+  int depth;      /* samples per pixel */
+  int maxval;     /* 1 for PBM, 0 for PFM */
+  int endianess;  /* PFM only: -1 little-endian, +1 big-endian */
+  char tupltype[PNM_TUPLTYPE_LEN]; /* PAM only, "" if none */
+} pnm_info;
+
+/* Incremental row reader/writer (opaque). */
+typedef struct pnm_reader pnm_reader;
+typedef struct pnm_writer pnm_writer;
+typedef struct pnm_batch pnm_batch;
+typedef struct pnm_frames pnm_frames;
+typedef struct pnm_pool pnm_pool;
+
+/* Log levels passed to pnm_log_fn callbacks. */
+#define PNM_LOG_INFO           0
+#define PNM_LOG_ERROR          1
+
+typedef void (*pnm_log_fn)(void *user, int level, const char *msg);
+
+/* Decoding context. Apart from the opt-in statistics, the library keeps no
+ * global state, so each thread may use its own context at the same time as
+ * others. 
+ */
+typedef struct {
+  pnm_log_fn log;   /* NULL for silent operation */
+  void *log_user;   /* passed to log */
+  int   error;      /* last error code */
+} pnm_ctx;
+
+/* Samples per line of ASCII PBM/PGM files written by pnm_writer. */
+#define PNM_LINEVALS          16
+
+/* I/O statistics, counted per thread while enabled with pnm_stats_enable 
+ * and summed over all threads by pnm_stats_get. A read or write is one 
+ * pass over (part of) a raster, such as a read_*_data/write_*_file call or 
+ * a pnm_read_rows/pnm_write_rows call. Times are in nanoseconds; the 
+ * conversion time of a pass is its duration less its stdio time, so it 
+ * includes the time spent waiting for worker threads.
+ */
+typedef struct {
+  uint64_t reads, writes;   /* raster passes */
+  uint64_t bytes_read;      /* header and raster bytes */
+  uint64_t bytes_written;
+  uint64_t samples;         /* samples decoded or encoded */
+  uint64_t stdio_calls;     /* fread/fwrite/getc/ungetc/fprintf calls */
+  uint64_t header_ns;       /* header parsing and writing */
+  uint64_t io_ns;           /* raster fread/fwrite calls */
+  uint64_t convert_ns;      /* raster decoding and encoding */
+} pnm_stats;
+
+
 /* PNM/PFM API. */
 int  get_pnm_type(FILE *f);
-int read_pbm_header(FILE *f, int *img_xdim, int *img_ydim, int *is_ascii);
-int read_pgm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors,
+int  pnm_read_header(FILE *f, pnm_info *info);
+size_t read_pbm_header(FILE *f, int *img_xdim, int *img_ydim, int *is_ascii);
+size_t read_pgm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors,
        int *is_ascii);
-int read_ppm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors,
+size_t read_ppm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_colors,
        int *is_ascii);
-int read_pfm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_type,
+size_t read_pfm_header(FILE *f, int *img_xdim, int *img_ydim, int *img_type,
        int *endianess);
+size_t read_pam_header(FILE *f, int *img_xdim, int *img_ydim, int *img_depth,
+       int *img_colors, char *tupltype);
 void read_pbm_data(FILE *f, int *img_in, int is_ascii);
 void read_pgm_data(FILE *f, int *img_in, int is_ascii);
 void read_ppm_data(FILE *f, int *img_in, int is_ascii);
 void read_pfm_data(FILE *f, float *img_in, int img_type, int endianess);
+void read_pam_data(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int img_depth, int img_colors);
+void read_pbm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int is_ascii);
+void read_pgm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void read_ppm_data_ex(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void read_pbm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int is_ascii, int nthreads);
+void read_pgm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii, int nthreads);
+void read_ppm_data_mt(FILE *f, int *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii, int nthreads);
 void write_pbm_file(FILE *f, int *img_out,
        int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals, 
        int is_ascii);
@@ -71,6 +185,115 @@ void write_ppm_file(FILE *f, int *img_out,
        int img_colors, int is_ascii);
 void write_pfm_file(FILE *f, float *img_out,
        int x_size, int y_size, int img_type, int endianess);
+void write_pam_file(FILE *f, int *img_out,
+       int x_size, int y_size, int depth, int img_colors, 
+       const char *tupltype);
+void write_pbm_file_mt(FILE *f, int *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals, 
+       int is_ascii, int nthreads);
+void write_pgm_file_mt(FILE *f, int *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int linevals, int is_ascii, int nthreads);
+void write_ppm_file_mt(FILE *f, int *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int is_ascii, int nthreads);
+
+/* Native-width (8/16-bit) sample API. */
+int    pnm_sample_type(int img_colors);
+size_t pnm_sample_size(int sample_type);
+void  *pnm_image_alloc(const pnm_info *info, int sample_type, size_t *stride);
+void   pnm_image_free(void *buf);
+void read_pbm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+       int is_ascii);
+void read_pgm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void read_pgm_data_u16(FILE *f, uint16_t *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void read_ppm_data_u8(FILE *f, uint8_t *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void read_ppm_data_u16(FILE *f, uint16_t *img_in, int img_xdim, int img_ydim,
+       int img_colors, int is_ascii);
+void write_pbm_file_u8(FILE *f, const uint8_t *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, int linevals, 
+       int is_ascii);
+void write_pgm_file_u8(FILE *f, const uint8_t *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int linevals, int is_ascii);
+void write_pgm_file_u16(FILE *f, const uint16_t *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int linevals, int is_ascii);
+void write_ppm_file_u8(FILE *f, const uint8_t *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int is_ascii);
+void write_ppm_file_u16(FILE *f, const uint16_t *img_out,
+       int x_size, int y_size, int x_scale_val, int y_scale_val, 
+       int img_colors, int is_ascii);
+
+/* Memory-mapped (zero-copy) API. */
+int  pnm_map(const char *file_name, pnm_view *view);
+void pnm_unmap(pnm_view *view);
+
+/* Incremental (row-range) API. */
+int  pnm_reader_open(pnm_reader **reader, FILE *f, int sample_type,
+       pnm_info *info);
+int  pnm_reader_open_info(pnm_reader **reader, FILE *f, int sample_type,
+       const pnm_info *info);
+int  pnm_read_rows(pnm_reader *reader, void *buf, int nrows);
+void pnm_reader_close(pnm_reader *reader);
+int  pnm_writer_open(pnm_writer **writer, FILE *f, int sample_type,
+       const pnm_info *info);
+int  pnm_write_rows(pnm_writer *writer, const void *buf, int nrows);
+int  pnm_read_rows_strided(pnm_reader *reader, void *buf, size_t stride,
+       int nrows);
+int  pnm_write_rows_strided(pnm_writer *writer, const void *buf, 
+       size_t stride, int nrows);
+int  pnm_writer_close(pnm_writer *writer);
+
+/* Multi-image stream API. */
+int  pnm_frames_open(pnm_frames **frames, FILE *f, int sample_type);
+int  pnm_frames_next(pnm_frames *frames, pnm_info *info, void **buf);
+void pnm_frames_close(pnm_frames *frames);
+
+/* Batch read-ahead API. */
+int  pnm_batch_open(pnm_batch **batch, const char * const *names, int nfiles,
+       int depth);
+int  pnm_batch_next(pnm_batch *batch, FILE **f);
+const char *pnm_batch_name(const pnm_batch *batch);
+void pnm_batch_close(pnm_batch *batch);
+
+/* Frame buffer pool API. */
+int   pnm_pool_open(pnm_pool **pool, int max_idle);
+void *pnm_pool_get(pnm_pool *pool, const pnm_info *info, int sample_type,
+        size_t *stride);
+void  pnm_pool_put(pnm_pool *pool, void *buf);
+int   pnm_pool_read(pnm_pool *pool, FILE *f, const pnm_info *info,
+        int sample_type, void **buf, size_t *stride);
+void  pnm_pool_close(pnm_pool *pool);
+
+/* Tone mapping (HDR PFM to PNM) API. */
+int  pnm_tonemap(void *dst, int sample_type, const float *src, size_t n,
+       float exposure, float gamma, int maxval);
+int  pnm_tonemap_pfm(FILE *fin, FILE *fout, float exposure, float gamma,
+       int maxval, int nthreads);
+
+/* Statistics API. */
+void pnm_stats_enable(int on);
+void pnm_stats_get(pnm_stats *stats);
+void pnm_stats_reset(void);
+
+/* Context API: status codes, opt-in logging, no exit() calls. */
+void pnm_ctx_init(pnm_ctx *ctx);
+void pnm_ctx_set_log(pnm_ctx *ctx, pnm_log_fn log, void *user);
+const char *pnm_strerror(int err);
+int  pnm_ctx_read_header(pnm_ctx *ctx, FILE *f, pnm_info *info);
+int  pnm_ctx_read_data(pnm_ctx *ctx, FILE *f, const pnm_info *info,
+       void *buf, int sample_type);
+int  pnm_ctx_write(pnm_ctx *ctx, FILE *f, const pnm_info *info,
+       const void *buf, int sample_type);
+int  pnm_ctx_read_data_strided(pnm_ctx *ctx, FILE *f, const pnm_info *info,
+       void *buf, size_t stride, int sample_type);
+int  pnm_ctx_write_strided(pnm_ctx *ctx, FILE *f, const pnm_info *info,
+       const void *buf, size_t stride, int sample_type);
 
 /* Helper/auxiliary functions. */
 int   ReadFloat(FILE *fptr, float *f, int swap);
@@ -0,0 +1,666 @@
+/*
+ * File       : pnmsimd.c                                                        
+ * Description: Sample conversion kernels for libpnmio. SSE2 is used when the
+ *              compiler targets it; a portable scalar version is used 
+ *              otherwise and for the tails of every kernel.
+ * Author     : Nikolaos Kavvadias <nikolaos.kavvadias@gmail.com>                
+ * Copyright  : (C) Nikolaos Kavvadias 2012-2022
+ * Website    : http://www.nkavvadias.com                            
+ *                                                                          
+ * This file is part of libpnmio, and is distributed under the terms of the  
+ * Modified BSD License.
+ *
+ * A copy of the Modified BSD License is included with this distribution 
+ * in the file LICENSE.
+ * libpnmio is free software: you can redistribute it and/or modify it under the
+ * terms of the Modified BSD License. 
+ * libpnmio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the Modified BSD License for more details.
+ * 
+ * You should have received a copy of the Modified BSD License along with 
+ * libpnmio. If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "pnmsimd.h"
+
+
+/* pnm_simd_widen_u8_int:
+ * Widen n unsigned 8-bit samples to int.
+ */
+void pnm_simd_widen_u8_int(int *dst, const unsigned char *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v  = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i *)(dst + i +  0), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(dst + i +  4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(dst + i +  8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = src[i];
+  }
+}
+
+/* pnm_simd_widen_u8_u16:
+ * Widen n unsigned 8-bit samples to 16 bits.
+ */
+void pnm_simd_widen_u8_u16(uint16_t *dst, const unsigned char *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i + 0), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = src[i];
+  }
+}
+
+/* pnm_simd_widen_u16_int:
+ * Widen n unsigned 16-bit samples to int.
+ */
+void pnm_simd_widen_u16_int(int *dst, const uint16_t *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i + 0), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = src[i];
+  }
+}
+
+/* pnm_simd_bswap16:
+ * Swap the bytes of n 16-bit samples; dst may be equal to src.
+ */
+void pnm_simd_bswap16(uint16_t *dst, const uint16_t *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i + 0));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    v0 = _mm_or_si128(_mm_slli_epi16(v0, 8), _mm_srli_epi16(v0, 8));
+    v1 = _mm_or_si128(_mm_slli_epi16(v1, 8), _mm_srli_epi16(v1, 8));
+    _mm_storeu_si128((__m128i *)(dst + i + 0), v0);
+    _mm_storeu_si128((__m128i *)(dst + i + 8), v1);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (uint16_t)((src[i] << 8) | (src[i] >> 8));
+  }
+}
+
+/* pnm_simd_bswap32:
+ * Swap the bytes of n 32-bit samples (4*n bytes), such as PFM floats; dst 
+ * may be equal to src.
+ */
+void pnm_simd_bswap32(void *dst, const void *src, size_t n)
+{
+  const unsigned char *s = (const unsigned char *)src;
+  unsigned char *d = (unsigned char *)dst;
+  unsigned char b0, b1;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(s + 4*i +  0));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s + 4*i + 16));
+    /* Swap the bytes of each 16-bit half, then the halves. */
+    v0 = _mm_or_si128(_mm_slli_epi16(v0, 8), _mm_srli_epi16(v0, 8));
+    v1 = _mm_or_si128(_mm_slli_epi16(v1, 8), _mm_srli_epi16(v1, 8));
+    v0 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v0, _MM_SHUFFLE(2, 3, 0, 1)),
+           _MM_SHUFFLE(2, 3, 0, 1));
+    v1 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v1, _MM_SHUFFLE(2, 3, 0, 1)),
+           _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_si128((__m128i *)(d + 4*i +  0), v0);
+    _mm_storeu_si128((__m128i *)(d + 4*i + 16), v1);
+  }
+#endif
+  for (; i < n; i++) {
+    b0 = s[4*i+0];
+    b1 = s[4*i+1];
+    d[4*i+0] = s[4*i+3];
+    d[4*i+1] = s[4*i+2];
+    d[4*i+2] = b1;
+    d[4*i+3] = b0;
+  }
+}
+
+/* pnm_simd_be16_int:
+ * Convert n big-endian 16-bit samples (2*n bytes) to int.
+ */
+void pnm_simd_be16_int(int *dst, const unsigned char *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2*i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i + 0), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[2*i] << 8) | src[2*i+1];
+  }
+}
+
+/* pnm_simd_narrow_int_u8:
+ * Narrow n int samples to 8 bits, clamping them to 0..255.
+ */
+void pnm_simd_narrow_int_u8(unsigned char *dst, const int *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i +  0));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i +  4));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i +  8));
+    __m128i v3 = _mm_loadu_si128((const __m128i *)(src + i + 12));
+    __m128i lo = _mm_packs_epi32(v0, v1);
+    __m128i hi = _mm_packs_epi32(v2, v3);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[i] < 0) ? 0 : (src[i] > 255) ? 255 : (unsigned char)src[i];
+  }
+}
+
+/* pnm_simd_narrow_u16_u8:
+ * Narrow n unsigned 16-bit samples to 8 bits, clamping them to 255.
+ */
+void pnm_simd_narrow_u16_u8(unsigned char *dst, const uint16_t *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  /* Saturating add/subtract of 0xFF00 yields min(v, 255). */
+  const __m128i bias = _mm_set1_epi16((short)0xFF00);
+  for (; i + 16 <= n; i += 16) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(src + i + 0));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    lo = _mm_subs_epu16(_mm_adds_epu16(lo, bias), bias);
+    hi = _mm_subs_epu16(_mm_adds_epu16(hi, bias), bias);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[i] > 255) ? 255 : (unsigned char)src[i];
+  }
+}
+
+/* pnm_simd_narrow_int_u16:
+ * Narrow n int samples to 16 bits, clamping them to 0..65535.
+ */
+void pnm_simd_narrow_int_u16(uint16_t *dst, const int *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  /* SSE2 has no unsigned 32-to-16 bit pack; clamp, then bias the values 
+   * into the signed range and back.
+   */
+  const __m128i max  = _mm_set1_epi32(65535);
+  const __m128i bias = _mm_set1_epi32(32768);
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  for (; i + 8 <= n; i += 8) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i + 0));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 4));
+    v0 = _mm_andnot_si128(_mm_srai_epi32(v0, 31), v0);
+    v1 = _mm_andnot_si128(_mm_srai_epi32(v1, 31), v1);
+    v0 = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(v0, max), max),
+           _mm_andnot_si128(_mm_cmpgt_epi32(v0, max), v0));
+    v1 = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(v1, max), max),
+           _mm_andnot_si128(_mm_cmpgt_epi32(v1, max), v1));
+    v0 = _mm_sub_epi32(v0, bias);
+    v1 = _mm_sub_epi32(v1, bias);
+    _mm_storeu_si128((__m128i *)(dst + i),
+      _mm_xor_si128(_mm_packs_epi32(v0, v1), flip));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[i] < 0) ? 0 : (src[i] > 65535) ? 65535 : (uint16_t)src[i];
+  }
+}
+
+#if defined(__SSE2__)
+/* unpack16_bits:
+ * Expand the 16 bits of two bytes, MSB first, to 16 bytes of 0 or 1.
+ */
+static __m128i unpack16_bits(const unsigned char *src)
+{
+  const __m128i bits = _mm_set_epi8(
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+  __m128i v = _mm_cvtsi32_si128(src[0] | (src[1] << 8));
+
+  /* Broadcast each byte to one half of the vector. */
+  v = _mm_unpacklo_epi8(v, v);
+  v = _mm_unpacklo_epi16(v, v);
+  v = _mm_unpacklo_epi32(v, v);
+  v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+  return _mm_and_si128(v, _mm_set1_epi8(1));
+}
+
+/* pack16_bits:
+ * Pack 16 bytes that are either 0 or 0xFF into two bytes, MSB first.
+ */
+static unsigned int pack16_bits(__m128i v)
+{
+  /* Reverse the bytes of each 8-byte half, so that movemask yields the 
+   * first pixel in the most significant bit of each byte.
+   */
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  return (unsigned int)_mm_movemask_epi8(v);
+}
+#endif
+
+/* pnm_simd_unpack_bits_u8:
+ * Expand n PBM pixels, packed 8 per byte with the first pixel in the MSB,
+ * to one byte (0 or 1) per pixel.
+ */
+void pnm_simd_unpack_bits_u8(unsigned char *dst, const unsigned char *src,
+  size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    _mm_storeu_si128((__m128i *)(dst + i), unpack16_bits(src + i/8));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[i >> 3] >> (7 - (i & 7))) & 0x1;
+  }
+}
+
+/* pnm_simd_unpack_bits_int:
+ * Expand n PBM pixels, packed 8 per byte with the first pixel in the MSB,
+ * to one int (0 or 1) per pixel.
+ */
+void pnm_simd_unpack_bits_int(int *dst, const unsigned char *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v  = unpack16_bits(src + i/8);
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i *)(dst + i +  0), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(dst + i +  4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(dst + i +  8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (src[i >> 3] >> (7 - (i & 7))) & 0x1;
+  }
+}
+
+/* pnm_simd_pack_bits_u8:
+ * Pack n PBM pixels, one byte each (nonzero meaning black), 8 per byte with 
+ * the first pixel in the MSB. The last byte is padded with zero bits.
+ */
+void pnm_simd_pack_bits_u8(unsigned char *dst, const unsigned char *src,
+  size_t n)
+{
+  size_t i = 0, k;
+  unsigned int m;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    m = ~pack16_bits(_mm_cmpeq_epi8(v, zero));
+    dst[i/8 + 0] = (unsigned char)m;
+    dst[i/8 + 1] = (unsigned char)(m >> 8);
+  }
+#endif
+  for (; i < n; i += 8) {
+    m = 0;
+    for (k = 0; (k < 8) && (i + k < n); k++) {
+      m |= (src[i+k] != 0) << (7 - k);
+    }
+    dst[i/8] = (unsigned char)m;
+  }
+}
+
+/* pnm_simd_pack_bits_int:
+ * Pack n PBM pixels, one int each (nonzero meaning black), 8 per byte with 
+ * the first pixel in the MSB. The last byte is padded with zero bits.
+ */
+void pnm_simd_pack_bits_int(unsigned char *dst, const int *src, size_t n)
+{
+  size_t i = 0, k;
+  unsigned int m;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i +  0)), zero);
+    __m128i v1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i +  4)), zero);
+    __m128i v2 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i +  8)), zero);
+    __m128i v3 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i + 12)), zero);
+    __m128i v  = _mm_packs_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+    m = ~pack16_bits(v);
+    dst[i/8 + 0] = (unsigned char)m;
+    dst[i/8 + 1] = (unsigned char)(m >> 8);
+  }
+#endif
+  for (; i < n; i += 8) {
+    m = 0;
+    for (k = 0; (k < 8) && (i + k < n); k++) {
+      m |= (src[i+k] != 0) << (7 - k);
+    }
+    dst[i/8] = (unsigned char)m;
+  }
+}
+
+/* pnm_simd_skip_space:
+ * Return a pointer to the first byte in [p, end) that is not whitespace 
+ * (space, \t, \n, \v, \f, \r), or end.
+ */
+const unsigned char *pnm_simd_skip_space(const unsigned char *p,
+  const unsigned char *end)
+{
+#if defined(__SSE2__)
+  const __m128i blank = _mm_set1_epi8(' ');
+  const __m128i tab   = _mm_set1_epi8('\t');
+  const __m128i four  = _mm_set1_epi8(4);
+  unsigned int mask;
+
+  /* Single separators are the common case; test them first. */
+  if ((p < end) && (*p != ' ') && ((unsigned char)(*p - '\t') > 4)) {
+    return p;
+  }
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i t = _mm_sub_epi8(v, tab);
+    __m128i s = _mm_or_si128(_mm_cmpeq_epi8(v, blank),
+                  _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+    mask = ~(unsigned int)_mm_movemask_epi8(s) & 0xFFFF;
+    if (mask != 0) {
+#if defined(__GNUC__)
+      return p + __builtin_ctz(mask);
+#else
+      while ((mask & 1) == 0) {
+        mask >>= 1;
+        p++;
+      }
+      return p;
+#endif
+    }
+  }
+#endif
+  while ((p < end) && ((*p == ' ') || ((unsigned char)(*p - '\t') <= 4))) {
+    p++;
+  }
+  return p;
+}
+
+/* popcount16:
+ * Number of bits set in a 16-bit mask.
+ */
+static unsigned int popcount16(unsigned int m)
+{
+#if defined(__GNUC__)
+  return (unsigned int)__builtin_popcount(m);
+#else
+  unsigned int c = 0;
+  for (; m != 0; m &= m - 1) {
+    c++;
+  }
+  return c;
+#endif
+}
+
+/* pnm_simd_count_tokens:
+ * Count the decimal tokens of [p, end), or its '0'/'1' bytes if bits is set.
+ * Counting stops at the first byte that is neither a token byte nor 
+ * whitespace, and *irregular is set if there is one.
+ */
+size_t pnm_simd_count_tokens(const unsigned char *p, const unsigned char *end,
+  int bits, int *irregular)
+{
+  size_t count = 0;
+  unsigned int in_token = 0, tok, d;
+
+#if defined(__SSE2__)
+  const __m128i zero  = _mm_set1_epi8('0');
+  const __m128i top   = _mm_set1_epi8(bits ? 1 : 9);
+  const __m128i blank = _mm_set1_epi8(' ');
+  const __m128i tab   = _mm_set1_epi8('\t');
+  const __m128i four  = _mm_set1_epi8(4);
+
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i d = _mm_sub_epi8(v, zero);
+    __m128i t = _mm_sub_epi8(v, tab);
+    __m128i s = _mm_or_si128(_mm_cmpeq_epi8(v, blank),
+                  _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+    tok = (unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_min_epu8(d, top), d));
+    if ((tok | (unsigned int)_mm_movemask_epi8(s)) != 0xFFFF) {
+      break;
+    }
+    /* Count the first byte of each run of digits. */
+    count   += popcount16(bits ? tok : tok & ~((tok << 1) | in_token));
+    in_token = (tok >> 15) & 1;
+  }
+#endif
+  for (; p < end; p++) {
+    d   = (unsigned int)(unsigned char)(*p - '0');
+    tok = bits ? (d < 2) : (d < 10);
+    if (!tok && (*p != ' ') && ((unsigned char)(*p - '\t') > 4)) {
+      break;
+    }
+    count   += bits ? tok : (tok & !in_token);
+    in_token = tok;
+  }
+  *irregular = (p < end);
+  return count;
+}
+
+/* tone_sample:
+ * Scale a float sample, clamp it to [0, 1] (NaN giving 0) and map it 
+ * through a tone curve table, rounding to the nearest output level.
+ */
+static int tone_sample(float v, float scale, const float *lut)
+{
+  float x = v * scale, f, y;
+  uint32_t b, k;
+
+  if (!(x > 0.0f)) {
+    x = 0.0f;
+  } else if (x > 1.0f) {
+    x = 1.0f;
+  }
+  memcpy(&b, &x, sizeof(b));
+  if (b < PNM_TONE_BASE) {
+    /* Below the table, the curve is taken as linear. */
+    y = x * (lut[0] * 16777216.0f);
+  } else {
+    k = (b - PNM_TONE_BASE) >> 16;
+    f = (float)(int)((b - PNM_TONE_BASE) & 0xFFFF) * (1.0f / 65536.0f);
+    y = lut[k] + f * (lut[k+1] - lut[k]);
+  }
+  return (int)(y + 0.5f);
+}
+
+#if defined(__SSE2__)
+/* tone4:
+ * SSE2 version of tone_sample for 4 samples. The table lookups are 
+ * scalar loads; everything else stays in vector registers.
+ */
+static __m128i tone4(const float *src, __m128 scale, const float *lut)
+{
+  const __m128i base  = _mm_set1_epi32((int)PNM_TONE_BASE);
+  const __m128i low16 = _mm_set1_epi32(0xFFFF);
+  int k[4];
+  __m128 x, f, lo, hi, y, ys, small;
+  __m128i b, d;
+
+  x = _mm_mul_ps(_mm_loadu_ps(src), scale);
+  x = _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  b = _mm_castps_si128(x);
+  d = _mm_sub_epi32(b, base);
+  small = _mm_castsi128_ps(_mm_cmplt_epi32(b, base));
+  f = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(d, low16)), 
+        _mm_set1_ps(1.0f / 65536.0f));
+  _mm_storeu_si128((__m128i *)k, 
+    _mm_andnot_si128(_mm_castps_si128(small), _mm_srli_epi32(d, 16)));
+  lo = _mm_setr_ps(lut[k[0]],   lut[k[1]],   lut[k[2]],   lut[k[3]]);
+  hi = _mm_setr_ps(lut[k[0]+1], lut[k[1]+1], lut[k[2]+1], lut[k[3]+1]);
+  y  = _mm_add_ps(lo, _mm_mul_ps(f, _mm_sub_ps(hi, lo)));
+  ys = _mm_mul_ps(x, _mm_set1_ps(lut[0] * 16777216.0f));
+  y  = _mm_or_ps(_mm_and_ps(small, ys), _mm_andnot_ps(small, y));
+  return _mm_cvttps_epi32(_mm_add_ps(y, _mm_set1_ps(0.5f)));
+}
+#endif
+
+/* pnm_simd_tonemap_u8:
+ * Tone map n float samples, scaled by scale, to 8 bits with a tone curve 
+ * table (see PNM_TONE_BASE) for a maxval of 255 or less.
+ */
+void pnm_simd_tonemap_u8(unsigned char *dst, const float *src, size_t n,
+  float scale, const float *lut)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 s = _mm_set1_ps(scale);
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_packs_epi32(tone4(src + i +  0, s, lut),
+                                tone4(src + i +  4, s, lut));
+    __m128i b = _mm_packs_epi32(tone4(src + i +  8, s, lut),
+                                tone4(src + i + 12, s, lut));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (unsigned char)tone_sample(src[i], scale, lut);
+  }
+}
+
+/* pnm_simd_tonemap_u16:
+ * Tone map n float samples, scaled by scale, to 16 bits with a tone curve 
+ * table (see PNM_TONE_BASE).
+ */
+void pnm_simd_tonemap_u16(uint16_t *dst, const float *src, size_t n,
+  float scale, const float *lut)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128  s    = _mm_set1_ps(scale);
+  const __m128i bias = _mm_set1_epi32(32768);
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  for (; i + 8 <= n; i += 8) {
+    /* Bias to the signed range for the saturating pack, then flip back. */
+    __m128i a = _mm_sub_epi32(tone4(src + i + 0, s, lut), bias);
+    __m128i b = _mm_sub_epi32(tone4(src + i + 4, s, lut), bias);
+    _mm_storeu_si128((__m128i *)(dst + i), 
+      _mm_xor_si128(_mm_packs_epi32(a, b), flip));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (uint16_t)tone_sample(src[i], scale, lut);
+  }
+}
+
+/* pnm_simd_replicate:
+ * Repeat each of n pixels of size bytes scale times, as in a nearest 
+ * neighbour enlargement of a row; dst holds n*scale pixels and must not 
+ * overlap src.
+ */
+void pnm_simd_replicate(void *dst, const void *src, size_t n, size_t size,
+  int scale)
+{
+  unsigned char *d = dst;
+  const unsigned char *s = src;
+  size_t i = 0, k, span = size * (size_t)scale;
+
+#if defined(__SSE2__)
+  if ((scale == 2) && (size == 1)) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      _mm_storeu_si128((__m128i *)(d + 2*i +  0), _mm_unpacklo_epi8(v, v));
+      _mm_storeu_si128((__m128i *)(d + 2*i + 16), _mm_unpackhi_epi8(v, v));
+    }
+  } else if ((scale == 2) && (size == 2)) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + 2*i));
+      _mm_storeu_si128((__m128i *)(d + 4*i +  0), _mm_unpacklo_epi16(v, v));
+      _mm_storeu_si128((__m128i *)(d + 4*i + 16), _mm_unpackhi_epi16(v, v));
+    }
+  } else if ((scale == 2) && (size == 4)) {
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + 4*i));
+      _mm_storeu_si128((__m128i *)(d + 8*i +  0), _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i *)(d + 8*i + 16), _mm_unpackhi_epi32(v, v));
+    }
+  } else if ((span >= 16) && ((size == 1) || (size == 2) || (size == 4))) {
+    /* Fill the span of each pixel with a broadcast of it; the last store 
+     * overlaps the previous one, at an offset that is a multiple of size.
+     */
+    for (; i < n; i++) {
+      uint16_t h;
+      uint32_t w;
+      __m128i v;
+      if (size == 1) {
+        v = _mm_set1_epi8((char)s[i]);
+      } else if (size == 2) {
+        memcpy(&h, s + 2*i, 2);
+        v = _mm_set1_epi16((short)h);
+      } else {
+        memcpy(&w, s + 4*i, 4);
+        v = _mm_set1_epi32((int)w);
+      }
+      for (k = 0; k + 16 <= span; k += 16) {
+        _mm_storeu_si128((__m128i *)(d + i*span + k), v);
+      }
+      _mm_storeu_si128((__m128i *)(d + i*span + span - 16), v);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    for (k = 0; k < span; k += size) {
+      memcpy(d + i*span + k, s + i*size, size);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+/*
+ * File       : pnmsimd.h                                                        
+ * Description: Internal header for the sample conversion kernels of libpnmio.
+ * Author     : Nikolaos Kavvadias <nikolaos.kavvadias@gmail.com>                
+ * Copyright  : (C) Nikolaos Kavvadias 2012-2022
+ * Website    : http://www.nkavvadias.com                            
+ *                                                                          
+ * This file is part of libpnmio, and is distributed under the terms of the  
+ * Modified BSD License.
+ *
+ * A copy of the Modified BSD License is included with this distribution 
+ * in the file LICENSE.
+ * libpnmio is free software: you can redistribute it and/or modify it under the
+ * terms of the Modified BSD License. 
+ * libpnmio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the Modified BSD License for more details.
+ * 
+ * You should have received a copy of the Modified BSD License along with 
+ * libpnmio. If not, see <http://www.gnu.org/licenses/>. 
+ */
+ 
+#ifndef PNMSIMD_H
+#define PNMSIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tone curve tables of pnm_simd_tonemap_*: entry k holds the curve at the 
+ * float whose bit pattern is PNM_TONE_BASE + (k << 16), i.e. 128 entries per
+ * octave from 2^-24 up to 1.0 (entry PNM_TONE_ENTRIES - 2), scaled to maxval.
+ * The last entry repeats the one for 1.0.
+ */
+#define PNM_TONE_BASE      0x33800000u /* 2^-24 */
+#define PNM_TONE_ENTRIES   (24 * 128 + 2)
+
+/* Sample conversion kernels (not part of the public API). */
+void pnm_simd_widen_u8_int(int *dst, const unsigned char *src, size_t n);
+void pnm_simd_widen_u8_u16(uint16_t *dst, const unsigned char *src, size_t n);
+void pnm_simd_widen_u16_int(int *dst, const uint16_t *src, size_t n);
+void pnm_simd_bswap16(uint16_t *dst, const uint16_t *src, size_t n);
+void pnm_simd_bswap32(void *dst, const void *src, size_t n);
+void pnm_simd_be16_int(int *dst, const unsigned char *src, size_t n);
+void pnm_simd_narrow_int_u8(unsigned char *dst, const int *src, size_t n);
+void pnm_simd_narrow_u16_u8(unsigned char *dst, const uint16_t *src, size_t n);
+void pnm_simd_narrow_int_u16(uint16_t *dst, const int *src, size_t n);
+void pnm_simd_unpack_bits_u8(unsigned char *dst, const unsigned char *src,
+  size_t n);
+void pnm_simd_unpack_bits_int(int *dst, const unsigned char *src, size_t n);
+void pnm_simd_pack_bits_u8(unsigned char *dst, const unsigned char *src,
+  size_t n);
+void pnm_simd_pack_bits_int(unsigned char *dst, const int *src, size_t n);
+const unsigned char *pnm_simd_skip_space(const unsigned char *p,
+  const unsigned char *end);
+size_t pnm_simd_count_tokens(const unsigned char *p, const unsigned char *end,
+  int bits, int *irregular);
+void pnm_simd_tonemap_u8(unsigned char *dst, const float *src, size_t n,
+  float scale, const float *lut);
+void pnm_simd_tonemap_u16(uint16_t *dst, const float *src, size_t n,
+  float scale, const float *lut);
+void pnm_simd_replicate(void *dst, const void *src, size_t n, size_t size,
+  int scale);
+
+#endif /* PNMSIMD_H */
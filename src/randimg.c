@@ -32,7 +32,7 @@
 #define  PFM_SCALE        1.0
 
 int copied_imgout_file_name=0;
-int enable_pbm=1, enable_ppm=0, enable_pgm=0, enable_pfm=0;
+int enable_pbm=1, enable_ppm=0, enable_pgm=0, enable_pfm=0, enable_pam=0;
 int enable_ascii=1, enable_binary=0;
 int enable_rgb=1, enable_greyscale=0;
 char imgout_file_name[96];
@@ -55,10 +55,12 @@ static void print_usage()
   printf("*   -pgm:            Generate a PGM image with random content.\n");
   printf("*   -ppm:            Generate a PPM image with random content.\n");
   printf("*   -pfm:            Generate a PFM image with random content.\n");
+  printf("*   -pam:            Generate a PAM image with random content and an\n");
+  printf("*                    alpha channel.\n");
   printf("*   -ascii:          Emit PNM image in the ASCII format (default).\n");
   printf("*   -binary:         Emit PNM image in the binary format.\n");
-  printf("*   -rgb:            Emit a color PFM image (default).\n");
-  printf("*   -greyscale:      Emit a greyscale PFM image.\n");
+  printf("*   -rgb:            Emit a color PFM/PAM image (default).\n");
+  printf("*   -greyscale:      Emit a greyscale PFM/PAM image.\n");
   printf("*   -x <num>:        Value for the x-dimension of the image (default:256).\n");
   printf("*   -y <num>:        Value for the y-dimension of the image (default:256).\n");
   printf("* \n");
@@ -73,6 +75,7 @@ int main(int argc, char **argv)
   int *img_data = NULL;
   float *pfm_data = NULL;
   int i=0;
+  size_t k=0;
   long int x, y, c;
 
   // Read input arguments
@@ -90,21 +93,31 @@ int main(int argc, char **argv)
       enable_pgm = 0;
       enable_ppm = 0;
       enable_pfm = 0;
+      enable_pam = 0;
     } else if (strcmp("-pgm",argv[i]) == 0) {
 	    enable_pbm = 0;
       enable_pgm = 1;
       enable_ppm = 0;
       enable_pfm = 0;
+      enable_pam = 0;
     } else if (strcmp("-ppm",argv[i]) == 0) {
       enable_pbm = 0;
       enable_pgm = 0;
       enable_ppm = 1;
       enable_pfm = 0;
+      enable_pam = 0;
     } else if (strcmp("-pfm",argv[i]) == 0) {
       enable_pbm = 0;
       enable_pgm = 0;
       enable_ppm = 0;
       enable_pfm = 1;
+      enable_pam = 0;
+    } else if (strcmp("-pam",argv[i]) == 0) {
+      enable_pbm = 0;
+      enable_pgm = 0;
+      enable_ppm = 0;
+      enable_pfm = 0;
+      enable_pam = 1;
     } else if (strcmp("-ascii",argv[i]) == 0) {
       enable_ascii  = 1;
       enable_binary = 0;
@@ -142,7 +155,7 @@ int main(int argc, char **argv)
   }
 
   if (copied_imgout_file_name==1) {
-    if ((enable_ascii == 1) && (enable_pfm == 0)) {
+    if ((enable_ascii == 1) && (enable_pfm == 0) && (enable_pam == 0)) {
       if ((imgout_file = fopen(imgout_file_name,"w")) == NULL) {
         fprintf(stderr, "Error: Can't create the specified output file.\n");
         exit(1);
@@ -158,59 +171,70 @@ int main(int argc, char **argv)
   /* Perform operations. */
   if (enable_pfm == 1) {
     if (enable_rgb == 1) {
-      pfm_data = malloc((3 * x_dim * y_dim) * sizeof(float));
+      pfm_data = malloc(3 * (size_t)x_dim * y_dim * sizeof(float));
     } else if (enable_greyscale == 1) {
-      pfm_data = malloc((x_dim * y_dim) * sizeof(float));
+      pfm_data = malloc((size_t)x_dim * y_dim * sizeof(float));
     }      
   } else if (enable_ppm == 1) {
-    img_data = malloc((3 * x_dim * y_dim) * sizeof(int));
+    img_data = malloc(3 * (size_t)x_dim * y_dim * sizeof(int));
+  } else if (enable_pam == 1) {
+    img_data = malloc((enable_rgb ? 4 : 2) * (size_t)x_dim * y_dim * sizeof(int));
   } else {
-    img_data = malloc((x_dim * y_dim) * sizeof(int));
+    img_data = malloc((size_t)x_dim * y_dim * sizeof(int));
+  }
+  if ((img_data == NULL) && (pfm_data == NULL)) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
   }
   
   c = rand();
-  i = 0;
+  k = 0;
   for (y = 0; y < y_dim; y++) {
     for (x = 0; x < x_dim; x++) {
       if (enable_ppm == 1) {
 	      c = rand() & 0xff;
-	      img_data[3*i+0] = c;
+	      img_data[3*k+0] = c;
 	      c = rand() & 0xff;
-	      img_data[3*i+1] = c;
+	      img_data[3*k+1] = c;
 	      c = rand() & 0xff;
-	      img_data[3*i+2] = c;	
+	      img_data[3*k+2] = c;	
       } else if (enable_pgm == 1) {
         c = rand() & 0xff;
-		    img_data[i] = c;
+		    img_data[k] = c;
+	    } else if (enable_pam == 1) {
+	      int depth = (enable_rgb == 1) ? 4 : 2;
+	      for (c = 0; c < depth; c++) {
+	        img_data[depth*k+c] = rand() & 0xff;
+	      }
 	    } else if (enable_pbm == 1) {
 	      c = rand() & 0x1;
-		    img_data[i] = c;
+		    img_data[k] = c;
 	    }
-	    i++;
+	    k++;
     }
   } 
 
   if (enable_pfm == 1) {
-    i = 0;
+    k = 0;
     for (y = 0; y < y_dim; y++) {
       for (x = 0; x < x_dim; x++) {
         float f = 0.0;
         if (enable_rgb == 1) {
 //          f = ceil(PFM_SCALE * frand());
           f = PFM_SCALE * frand();
-          pfm_data[3*i+0] = f;
+          pfm_data[3*k+0] = f;
 //          f = ceil(PFM_SCALE * frand());
           f = PFM_SCALE * frand();
-          pfm_data[3*i+1] = f;
+          pfm_data[3*k+1] = f;
 //          f = ceil(PFM_SCALE * frand());
           f = PFM_SCALE * frand();
-          pfm_data[3*i+2] = f;
+          pfm_data[3*k+2] = f;
         } else if (enable_greyscale == 1) {
 //          f = ceil(PFM_SCALE * frand());
           f = PFM_SCALE * frand();
-          pfm_data[i]     = f;
+          pfm_data[k]     = f;
         }
-        i++;
+        k++;
       }
     }
   } 
@@ -227,10 +251,14 @@ int main(int argc, char **argv)
   } else if (enable_pfm == 1) {
     write_pfm_file(imgout_file, pfm_data,
     x_dim, y_dim, enable_rgb, (IS_LITTLE_ENDIAN ? -1 : 1));
+  } else if (enable_pam == 1) {
+    write_pam_file(imgout_file, img_data, x_dim, y_dim, 
+      (enable_rgb == 1) ? 4 : 2, 255, 
+      (enable_rgb == 1) ? "RGB_ALPHA" : "GRAYSCALE_ALPHA");
   }
   fclose(imgout_file);
   
-  if (enable_ppm == 1 || enable_pgm == 1 || enable_pbm == 1) {
+  if (enable_ppm == 1 || enable_pgm == 1 || enable_pbm == 1 || enable_pam == 1) {
     free(img_data);
   } else if (enable_pfm == 1) {
     free(pfm_data);
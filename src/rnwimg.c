@@ -1,6 +1,6 @@
 /*
  * File       : rnwimg.c                                                          
- * Description: Read an input PBM, PGM, PPM or PFM image and then write it 
+ * Description: Read an input PBM, PGM, PPM, PAM or PFM image and then write it 
  *              back (for testing purposes aka exercising the API).
  * Author     : Nikolaos Kavvadias <nikolaos.kavvadias@gmail.com>                
  * Copyright  : (C) Nikolaos Kavvadias 2014-2022
@@ -40,6 +40,12 @@ char *imgin_file_name, *imgout_file_name;
 FILE *imgin_file, *imgout_file;
 
 int x_dim=XDIM_DEFAULT, y_dim=YDIM_DEFAULT;
+int num_threads=1;
+int enable_frames=0;
+int enable_stats=0;
+int enable_aligned=0;
+int band_rows=0;
+int x_scale=1, y_scale=1;
 
 
 /* Print usage instructions for the "rnwimg" program.
@@ -52,13 +58,180 @@ static void print_usage()
   printf("* \n");
   printf("* Options:\n");
   printf("*   -h:              Print this help.\n");
-  printf("*   -i <infile>:     Read input from file <infile>.\n");
-  printf("*   -o <outfile>:    Write output to file <outfile>.\n");
+  printf("*   -i <infile>:     Read input from file <infile> (- for stdin).\n");
+  printf("*   -o <outfile>:    Write output to file <outfile> (- for stdout).\n");
+  printf("*   -f:              Read and write all the images (frames) stored back\n");
+  printf("*                    to back in <infile>.\n");
+  printf("*   -t <num>:        Decode and encode ASCII images with <num> threads\n");
+  printf("*                    (0 for one per processor). Default: 1.\n");
+  printf("*   -s:              Print I/O statistics to stderr.\n");
+  printf("*   -a:              Read and write the image through an aligned buffer\n");
+  printf("*                    with padded rows, in its native sample width.\n");
+  printf("*   -r <rows>:       Read and write the image <rows> rows at a time, in\n");
+  printf("*                    its native sample width.\n");
+  printf("*   -x <num>:        Enlarge PBM/PGM/PPM images <num> times across, by\n");
+  printf("*                    pixel replication. Default: 1.\n");
+  printf("*   -y <num>:        Enlarge PBM/PGM/PPM images <num> times down, by\n");
+  printf("*                    pixel replication. Default: 1.\n");
   printf("* \n");
   printf("* For further information, please refer to the website:\n");
   printf("* http://www.nkavvadias.com\n\n");
 }
 
+/* Print the I/O statistics gathered so far.
+ */
+static void print_stats(void)
+{
+  pnm_stats st;
+
+  pnm_stats_get(&st);
+  fprintf(stderr, "Info: reads = %llu, writes = %llu, samples = %llu\n",
+    (unsigned long long)st.reads, (unsigned long long)st.writes, 
+    (unsigned long long)st.samples);
+  fprintf(stderr, "Info: bytes read = %llu, bytes written = %llu, "
+    "stdio calls = %llu\n", (unsigned long long)st.bytes_read, 
+    (unsigned long long)st.bytes_written, (unsigned long long)st.stdio_calls);
+  fprintf(stderr, "Info: header = %.3f ms, I/O = %.3f ms, conversion = %.3f ms\n",
+    st.header_ns / 1e6, st.io_ns / 1e6, st.convert_ns / 1e6);
+}
+
+/* Open the output file and copy the frames of the input to it.
+ */
+static int copy_frames(void)
+{
+  pnm_frames *frames;
+  pnm_info info;
+  void *buf;
+  int err, nframes=0;
+
+  if ((copied_imgout_file_name==1) && (strcmp(imgout_file_name, "-") == 0)) {
+    imgout_file = stdout;
+  } else if ((copied_imgout_file_name==1) &&
+             ((imgout_file = fopen(imgout_file_name,"wb")) == NULL)) {
+    fprintf(stderr, "Error: Can't create the specified output file.\n");
+    exit(1);
+  }
+  if (pnm_frames_open(&frames, imgin_file, PNM_SAMPLE_INT) != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  while ((err = pnm_frames_next(frames, &info, &buf)) == 1) {
+    fprintf(stderr, "Info: frame %d: pnm_type = %d, %dx%d\n", nframes, 
+      info.pnm_type, info.width, info.height);
+    err = pnm_ctx_write(NULL, imgout_file, &info, buf, 
+      (info.maxval == 0) ? PNM_SAMPLE_FLOAT : PNM_SAMPLE_INT);
+    if (err != PNM_OK) {
+      break;
+    }
+    nframes++;
+  }
+  pnm_frames_close(frames);
+  fclose(imgin_file);
+  fclose(imgout_file);
+  if (err < 0) {
+    fprintf(stderr, "Error: frame %d: %s\n", nframes, pnm_strerror(err));
+    exit(1);
+  }
+  fprintf(stderr, "Info: %d frames\n", nframes);
+  if (enable_stats == 1) {
+    print_stats();
+  }
+  return 0;
+}
+
+/* Copy the image described by info through an aligned, padded buffer, 
+ * drawn from a frame buffer pool.
+ */
+static int copy_aligned(pnm_info *info)
+{
+  pnm_pool *pool;
+  pnm_ctx ctx;
+  void *buf;
+  size_t stride;
+  int sample_type, err;
+
+  sample_type = (info->maxval == 0) ? PNM_SAMPLE_FLOAT : 
+    pnm_sample_type(info->maxval);
+  if (pnm_pool_open(&pool, 1) != PNM_OK) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  pnm_ctx_init(&ctx);
+  if (((err = pnm_pool_read(pool, imgin_file, info, sample_type, &buf, 
+         &stride)) != PNM_OK) ||
+      ((err = pnm_ctx_write_strided(&ctx, imgout_file, info, buf, stride, 
+         sample_type)) != PNM_OK)) {
+    fprintf(stderr, "Error: %s\n", pnm_strerror(err));
+    exit(1);
+  }
+  fprintf(stderr, "Info: row stride = %lu bytes\n", (unsigned long)stride);
+  pnm_pool_put(pool, buf);
+  pnm_pool_close(pool);
+  fclose(imgin_file);
+  fclose(imgout_file);
+  if (enable_stats == 1) {
+    print_stats();
+  }
+  return 0;
+}
+
+/* Open the output file and copy the input to it in bands of band_rows 
+ * rows, so that only one band is held in memory.
+ */
+static int copy_rows(void)
+{
+  pnm_reader *reader;
+  pnm_writer *writer;
+  pnm_info info;
+  void *buf;
+  int sample_type, err, rows;
+
+  if ((copied_imgout_file_name==1) && (strcmp(imgout_file_name, "-") == 0)) {
+    imgout_file = stdout;
+  } else if ((copied_imgout_file_name==1) &&
+             ((imgout_file = fopen(imgout_file_name,"wb")) == NULL)) {
+    fprintf(stderr, "Error: Can't create the specified output file.\n");
+    exit(1);
+  }
+  /* The header is read once; the sample type follows from it. */
+  if ((err = pnm_read_header(imgin_file, &info)) != PNM_OK) {
+    fprintf(stderr, "Error: %s\n", pnm_strerror(err));
+    exit(1);
+  }
+  if ((info.pnm_type == PFM_RGB) || (info.pnm_type == PFM_GREYSCALE)) {
+    sample_type = PNM_SAMPLE_FLOAT;
+  } else {
+    sample_type = pnm_sample_type(info.maxval);
+  }
+  if (((err = pnm_reader_open_info(&reader, imgin_file, sample_type, &info)) != PNM_OK) ||
+      ((err = pnm_writer_open(&writer, imgout_file, sample_type, &info)) != PNM_OK)) {
+    fprintf(stderr, "Error: %s\n", pnm_strerror(err));
+    exit(1);
+  }
+  buf = malloc((size_t)band_rows * info.width * info.depth * 
+          pnm_sample_size(sample_type));
+  if (buf == NULL) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
+  while ((rows = pnm_read_rows(reader, buf, band_rows)) > 0) {
+    pnm_write_rows(writer, buf, rows);
+  }
+  pnm_reader_close(reader);
+  err = (rows < 0) ? rows : pnm_writer_close(writer);
+  if (err != PNM_OK) {
+    fprintf(stderr, "Error: %s\n", pnm_strerror(err));
+    exit(1);
+  }
+  free(buf);
+  fclose(imgin_file);
+  fclose(imgout_file);
+  if (enable_stats == 1) {
+    print_stats();
+  }
+  return 0;
+}
+
 /* The main "rnwimg" routine.
  */
 int main(int argc, char **argv)
@@ -67,6 +240,7 @@ int main(int argc, char **argv)
   float *pfm_data = NULL;
   int i=0;
   int pnm_type=0;
+  pnm_info info;
 
   // Read input arguments
   if (argc < 2) {
@@ -92,14 +266,44 @@ int main(int argc, char **argv)
         strcpy(imgout_file_name, argv[i]);
         copied_imgout_file_name = 1;
       }        
+    } else if (strcmp("-f", argv[i]) == 0) {
+      enable_frames = 1;
+    } else if (strcmp("-s", argv[i]) == 0) {
+      enable_stats = 1;
+    } else if (strcmp("-a", argv[i]) == 0) {
+      enable_aligned = 1;
+    } else if (strcmp("-r", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        band_rows = atoi(argv[i]);
+      }
+    } else if (strcmp("-x", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        x_scale = atoi(argv[i]);
+      }
+    } else if (strcmp("-y", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        y_scale = atoi(argv[i]);
+      }
+    } else if (strcmp("-t", argv[i]) == 0) {
+      if ((i+1) < argc) {
+        i++;
+        num_threads = atoi(argv[i]);
+      }
     } else {
       fprintf(stderr, "Error: Unknown command-line option.\n");
       exit(1);
     }
   }
 
+  pnm_stats_enable(enable_stats);
+
   /* Open input file. */
-  if (copied_imgin_file_name==1) {
+  if ((copied_imgin_file_name==1) && (strcmp(imgin_file_name, "-") == 0)) {
+    imgin_file = stdin;
+  } else if (copied_imgin_file_name==1) {
     if ((enable_ascii == 1) && (enable_pfm == 0)) {
       if ((imgin_file = fopen(imgin_file_name,"r")) == NULL) {
         fprintf(stderr, "Error: Can't open the specified input file.\n");
@@ -113,29 +317,42 @@ int main(int argc, char **argv)
     }
   }
 
-  /* Get the PNM/PFM image type. */
-  pnm_type = get_pnm_type(imgin_file);
-  fprintf(stderr, "Info: pnm_type = %d\n", pnm_type);
-  rewind(imgin_file);
+  /* Copy a multi-image stream frame by frame. */
+  if (enable_frames == 1) {
+    return copy_frames();
+  }
 
-  /* Read the image file header (the input file has been rewinded). */
-  int num_bytes = 0;
-  if ((pnm_type == PBM_ASCII) || (pnm_type == PBM_BINARY)) {
-    num_bytes = read_pbm_header(imgin_file, &x_dim, &y_dim, &enable_ascii);
-  } else if ((pnm_type == PGM_ASCII) || (pnm_type == PGM_BINARY)) {
-    num_bytes = read_pgm_header(imgin_file, &x_dim, &y_dim, &img_colors, &enable_ascii);
-  } else if ((pnm_type == PPM_ASCII) || (pnm_type == PPM_BINARY)) {
-    num_bytes = read_ppm_header(imgin_file, &x_dim, &y_dim, &img_colors, &enable_ascii);
-  } else if ((pnm_type == PFM_RGB) || (pnm_type == PFM_GREYSCALE)) {
-    num_bytes = read_pfm_header(imgin_file, &x_dim, &y_dim, &img_type, &endianess);
-    enable_pfm = 1;
-  } else {    
+  /* Copy the image in bands of rows. */
+  if (band_rows > 0) {
+    return copy_rows();
+  }
+
+  /* Read the image file header in a single pass (no rewind is needed, so 
+   * the input may be a pipe).
+   */
+  if (pnm_read_header(imgin_file, &info) != PNM_OK) {
     fprintf(stderr, "Error: Unknown PNM/PFM image format. Exiting...\n");
     exit(1);
   }
+  pnm_type = info.pnm_type;
+  fprintf(stderr, "Info: pnm_type = %d\n", pnm_type);
+  x_dim        = info.width;
+  y_dim        = info.height;
+  img_colors   = info.maxval;
+  enable_ascii = (pnm_type <= PPM_ASCII) ? 1 : 0;
+  size_t num_bytes = (size_t)x_dim * y_dim * info.depth * sizeof(int);
+  if ((pnm_type == PFM_RGB) || (pnm_type == PFM_GREYSCALE)) {
+    img_type   = (pnm_type == PFM_RGB) ? 1 : 0;
+    endianess  = info.endianess;
+    num_bytes  = (size_t)x_dim * y_dim * info.depth * sizeof(float);
+    enable_pfm = 1;
+  }
 
   /* Open output file. */
-  if (copied_imgout_file_name==1) {
+  if ((copied_imgout_file_name==1) && (strcmp(imgout_file_name, "-") == 0)) {
+    imgout_file = stdout;
+    free(imgout_file_name);
+  } else if (copied_imgout_file_name==1) {
     if ((enable_ascii == 1) && (enable_pfm == 0)) {
       if ((imgout_file = fopen(imgout_file_name,"w")) == NULL) {
         fprintf(stderr, "Error: Can't create the specified output file.\n");
@@ -150,20 +367,35 @@ int main(int argc, char **argv)
     free(imgout_file_name);
   }
 
+  /* Copy the image through an aligned buffer. */
+  if (enable_aligned == 1) {
+    return copy_aligned(&info);
+  }
+
+
   /* Perform operations. */
   if (pnm_type == PFM_RGB || pnm_type == PFM_GREYSCALE) {
     pfm_data = malloc(num_bytes);
   } else {
     img_data = malloc(num_bytes);
   }
+  if ((img_data == NULL) && (pfm_data == NULL)) {
+    fprintf(stderr, "Error: Out of memory!\n");
+    exit(1);
+  }
 
   /* Read the image data. */
   if ((pnm_type == PBM_ASCII) || (pnm_type == PBM_BINARY)) {
-    read_pbm_data(imgin_file, img_data, enable_ascii);
+    read_pbm_data_mt(imgin_file, img_data, x_dim, y_dim, enable_ascii, 
+      num_threads);
   } else if ((pnm_type == PGM_ASCII) || (pnm_type == PGM_BINARY)) {
-    read_pgm_data(imgin_file, img_data, enable_ascii);
+    read_pgm_data_mt(imgin_file, img_data, x_dim, y_dim, img_colors, 
+      enable_ascii, num_threads);
   } else if ((pnm_type == PPM_ASCII) || (pnm_type == PPM_BINARY)) {
-    read_ppm_data(imgin_file, img_data, enable_ascii);
+    read_ppm_data_mt(imgin_file, img_data, x_dim, y_dim, img_colors, 
+      enable_ascii, num_threads);
+  } else if (pnm_type == PAM) {
+    read_pam_data(imgin_file, img_data, x_dim, y_dim, info.depth, img_colors);
   } else if (enable_pfm == 1) {
     read_pfm_data(imgin_file, pfm_data, img_type, endianess);    
   }
@@ -172,16 +404,20 @@ int main(int argc, char **argv)
 
   /* Write the output image file. */
   if ((pnm_type == PBM_ASCII) || (pnm_type == PBM_BINARY)) {
-    write_pbm_file(imgout_file, img_data,
-      x_dim, y_dim, 1, 1, 32, enable_ascii
+    write_pbm_file_mt(imgout_file, img_data,
+      x_dim, y_dim, x_scale, y_scale, 32, enable_ascii, num_threads
     );
   } else if ((pnm_type == PGM_ASCII) || (pnm_type == PGM_BINARY)) {
-    write_pgm_file(imgout_file, img_data,
-      x_dim, y_dim, 1, 1, img_colors, 16, enable_ascii
+    write_pgm_file_mt(imgout_file, img_data,
+      x_dim, y_dim, x_scale, y_scale, img_colors, 16, enable_ascii, num_threads
     );
   } else if ((pnm_type == PPM_ASCII) || (pnm_type == PPM_BINARY)) {
-    write_ppm_file(imgout_file, img_data,
-      x_dim, y_dim, 1, 1, img_colors, enable_ascii
+    write_ppm_file_mt(imgout_file, img_data,
+      x_dim, y_dim, x_scale, y_scale, img_colors, enable_ascii, num_threads
+    );
+  } else if (pnm_type == PAM) {
+    write_pam_file(imgout_file, img_data,
+      x_dim, y_dim, info.depth, img_colors, info.tupltype
     );
   } else if (enable_pfm == 1) {
     write_pfm_file(imgout_file, pfm_data,
@@ -194,9 +430,12 @@ int main(int argc, char **argv)
     free(pfm_data);
   } else if (pnm_type == PBM_ASCII || pnm_type == PBM_BINARY ||
     pnm_type == PGM_ASCII || pnm_type == PGM_BINARY || 
-    pnm_type == PPM_ASCII || pnm_type == PPM_BINARY) {
+    pnm_type == PPM_ASCII || pnm_type == PPM_BINARY || pnm_type == PAM) {
     free(img_data);
   }
+  if (enable_stats == 1) {
+    print_stats();
+  }
 
   return 0;
 }
@@ -50,7 +50,7 @@ void sftbyvec(int *in_data, int *out_data, int vxval, int vyval)
 
   for (y = 0; y < y_dim; y++) {
     for (x = 0; x < x_dim; x++) {
-      out_data[y * x_dim + x] = 0x00;
+      out_data[(size_t)y * x_dim + x] = 0x00;
     }
   }
   for (y = 0; y < y_dim; y++) {
@@ -59,7 +59,7 @@ void sftbyvec(int *in_data, int *out_data, int vxval, int vyval)
       new_y = y + vyval;
       if ((new_x >= 0 && new_x < x_dim) &&
           (new_y >= 0 && new_y < y_dim)) {
-        out_data[new_y * x_dim + new_x] = in_data[y * x_dim + x];
+        out_data[(size_t)new_y * x_dim + new_x] = in_data[(size_t)y * x_dim + x];
       }
     }
   }
@@ -146,7 +146,7 @@ int main(int argc, char **argv)
   rewind(imgin_file);
 
   /* Read the image file header (the input file has been rewinded). */
-  int num_bytes = 0;
+  size_t num_bytes = 0;
   if (pnm_type == PGM_ASCII) {
     num_bytes = read_pgm_header(imgin_file, &x_dim, &y_dim, &img_colors, &enable_ascii);
   } else {    
@@ -0,0 +1,114 @@
+#!/bin/bash
+
+### TESTS
+#
+# Test batch conversion of a directory between the ASCII and binary formats.
+for variant in "ascii" "binary"
+do
+  echo "Converting the images of ../images to ${variant}: pnmconv-${variant}/"
+  mkdir -p pnmconv-${variant}
+  ../bin/pnmconv.exe -d ../images -${variant} -t 4 -o pnmconv-${variant} 2> /dev/null ||
+    echo "Error: pnmconv -${variant} failed"
+done
+
+# Test that the ASCII images survive the round trip to binary and back, by
+# comparing them with the copies written by rnwimg. pnmconv breaks the lines
+# of PBM images in other places, so these are compared token by token.
+echo "Converting pnmconv-binary/ back to ascii: pnmconv-roundtrip/"
+mkdir -p pnmconv-roundtrip
+for img in "feep.ascii.pgm" "haus.ascii.pbm" "haus.ascii.pgm" "haus.ascii.ppm" "lena.ascii.pgm" \
+           "letter_j.ascii.pbm" "ppmex1.ascii.ppm" "ppmex255.ascii.ppm"
+do
+  ../bin/rnwimg.exe -i ../images/${img} -o pnmconv-roundtrip/rnwimg.${img} > /dev/null
+  ../bin/pnmconv.exe pnmconv-binary/${img} -ascii -o pnmconv-roundtrip 2> /dev/null ||
+    echo "Error: pnmconv -ascii failed for ${img}"
+  case ${img} in
+  *.pbm)
+    cmp <(tr -s ' \n' '\n' < pnmconv-roundtrip/rnwimg.${img}) \
+        <(tr -s ' \n' '\n' < pnmconv-roundtrip/${img}) > /dev/null ||
+      echo "Error: pnmconv-roundtrip/${img} differs" ;;
+  *)
+    cmp pnmconv-roundtrip/rnwimg.${img} pnmconv-roundtrip/${img} ||
+      echo "Error: pnmconv-roundtrip/${img} differs" ;;
+  esac
+done
+
+# Test that two inputs with the same base name are refused, as both would be
+# written to the same output file.
+echo "Converting two files named feep.ascii.pgm: pnmconv-dup/"
+mkdir -p pnmconv-dup
+rm -f pnmconv-dup/*
+if ../bin/pnmconv.exe ../images/feep.ascii.pgm pnmconv-ascii/feep.ascii.pgm -o pnmconv-dup 2> /dev/null ||
+   [ -n "$(ls pnmconv-dup)" ]
+then
+  echo "Error: pnmconv accepted two inputs with the same output name"
+fi
+
+# Test batch conversion of a file list between the PNM variants.
+ls ../images/*.ppm ../images/*.pgm > pnmconv-list.txt
+for mode in "pbm" "pgm" "ppm"
+do
+  echo "Converting the images of pnmconv-list.txt to ${mode}: pnmconv-${mode}/"
+  mkdir -p pnmconv-${mode}
+  ../bin/pnmconv.exe -l pnmconv-list.txt -${mode} -o pnmconv-${mode} 2> /dev/null ||
+    echo "Error: pnmconv -${mode} failed"
+done
+
+# Test the luma of a red and a blue pixel: (299*255 + 500)/1000 = 76 and 
+# (114*255 + 500)/1000 = 29.
+echo "Converting a 2x1 PPM image to pgm: pnmconv-tiny/"
+mkdir -p pnmconv-tiny
+printf "P6\n2 1\n255\n\377\000\000\000\000\377" > tiny.ppm
+../bin/pnmconv.exe tiny.ppm -pgm -o pnmconv-tiny 2> /dev/null || echo "Error: pnmconv -pgm failed"
+printf "P5\n2 1\n255\n\114\035" | cmp - pnmconv-tiny/tiny.ppm || echo "Error: pnmconv-tiny/tiny.ppm differs"
+
+# Test tone mapping of PFM images to 8-bit and 16-bit PPM previews.
+for maxval in "255" "65535"
+do
+  echo "Tone mapping the PFM images of ../images with maxval ${maxval}: pnmconv-tonemap-${maxval}/"
+  mkdir -p pnmconv-tonemap-${maxval}
+  ../bin/pnmconv.exe ../images/*.pfm -tonemap -exposure 0.5 -maxval ${maxval} -t 4 -o pnmconv-tonemap-${maxval} 2> /dev/null ||
+    echo "Error: pnmconv -tonemap failed"
+done
+
+# Test tone mapping of known samples with the sRGB curve: 0 and NaN give 0, 
+# 1 and 2 give maxval, and 0.5 gives 1.055*0.5^(1/2.4) - 0.055 = 0.73536, 
+# i.e. 188 (\274) of 255 and 48192 (\274\100) of 65535. The little-endian 
+# Pf image has one row; the rows of the big-endian PF image are stored bottom
+# row first, so they come out swapped.
+echo "Tone mapping PFM images of known samples: pnmconv-tonemap-known-*/"
+printf "Pf\n5 1\n-1.0\n\000\000\000\000\000\000\000\077\000\000\200\077\000\000\000\100\000\000\300\177" > known.grey.pfm
+printf "PF\n1 2\n1.0\n\000\000\000\000\077\000\000\000\077\200\000\000\100\000\000\000\177\300\000\000\077\000\000\000" > known.rgb.pfm
+for maxval in "255" "65535"
+do
+  mkdir -p pnmconv-tonemap-known-${maxval}
+  ../bin/pnmconv.exe known.grey.pfm known.rgb.pfm -tonemap -maxval ${maxval} -o pnmconv-tonemap-known-${maxval} 2> /dev/null ||
+    echo "Error: pnmconv -tonemap failed"
+done
+printf "P5\n5 1\n255\n\000\274\377\377\000" | cmp - pnmconv-tonemap-known-255/known.grey.pgm ||
+  echo "Error: pnmconv-tonemap-known-255/known.grey.pgm differs"
+printf "P6\n1 2\n255\n\377\000\274\000\274\377" | cmp - pnmconv-tonemap-known-255/known.rgb.ppm ||
+  echo "Error: pnmconv-tonemap-known-255/known.rgb.ppm differs"
+printf "P5\n5 1\n65535\n\000\000\274\100\377\377\377\377\000\000" | cmp - pnmconv-tonemap-known-65535/known.grey.pgm ||
+  echo "Error: pnmconv-tonemap-known-65535/known.grey.pgm differs"
+printf "P6\n1 2\n65535\n\377\377\000\000\274\100\000\000\274\100\377\377" | cmp - pnmconv-tonemap-known-65535/known.rgb.ppm ||
+  echo "Error: pnmconv-tonemap-known-65535/known.rgb.ppm differs"
+
+# Test that a PFM written by randimg is read back in the byte order of its
+# header: tone mapped random samples in [0,1) are rarely black or white.
+echo "Tone mapping a random PFM image written by randimg: pnmconv-tonemap-randimg/"
+mkdir -p pnmconv-tonemap-randimg
+../bin/randimg.exe -x 64 -y 64 -pfm -rgb -o randimg.pfm > /dev/null
+../bin/pnmconv.exe randimg.pfm -tonemap -o pnmconv-tonemap-randimg 2> /dev/null || echo "Error: pnmconv failed"
+tail -c $((64*64*3)) pnmconv-tonemap-randimg/randimg.ppm | od -An -v -tu1 | tr -s ' ' '\n' | 
+  awk 'NF && ($1 == 0 || $1 == 255) { n++ } END { exit !(n < 64*64*3/10) }' || 
+  echo "Error: pnmconv-tonemap-randimg/randimg.ppm is mostly black or white"
+
+if [ $SECONDS -eq 1 ]
+then
+  units=second
+else
+  units=seconds
+fi
+
+echo "This script has been running for $SECONDS $units."
@@ -34,6 +34,22 @@ do
   done 
 done
 
+# Test PAM image generation (RGB_ALPHA and GRAYSCALE_ALPHA).
+for mode in "pam"
+do
+  for x in "16" "64" "256"
+  do
+    for y in "16" "64" "256" 
+    do
+      for variant in "rgb" "greyscale"
+      do      
+        echo "Generating image: randimg-${x}-${y}-${variant}.${mode}"
+        ../bin/randimg.exe -x ${x} -y ${y} -${mode} -${variant} -o randimg-${x}-${y}.${variant}.${mode}
+      done      
+    done 
+  done 
+done
+
 if [ $SECONDS -eq 1 ]
 then
   units=second
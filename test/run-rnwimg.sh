@@ -21,13 +21,37 @@ do
   ../bin/rnwimg.exe -i ../images/${img}.ascii.pgm -o ${img}.out.ascii.pgm
 done
 
+# Test multi-threaded decoding and encoding of ASCII PGM (P2)
+for img in "lena"
+do
+  echo "Read and write image: ${img}.ascii.pgm with 4 threads; write image: ${img}.mt.ascii.pgm"
+  ../bin/rnwimg.exe -i ../images/${img}.ascii.pgm -o ${img}.mt.ascii.pgm -t 4
+  cmp ${img}.out.ascii.pgm ${img}.mt.ascii.pgm || echo "Error: ${img}.mt.ascii.pgm differs"
+done
+
 # Test binary PGM (P5)
-for img in "feep" "haus" "lena92"
+for img in "feep" "haus" "lena92" "ramp16"
 do
   echo "Read image: ${img}.binary.pgm; write image: ${img}.out.binary.pgm"
   ../bin/rnwimg.exe -i ../images/${img}.binary.pgm -o ${img}.out.binary.pgm
 done
 
+# Test reading from a pipe (the header is parsed without rewinding)
+for img in "lena92"
+do
+  echo "Read image: ${img}.binary.pgm from stdin; write image: ${img}.pipe.binary.pgm"
+  cat ../images/${img}.binary.pgm | ../bin/rnwimg.exe -i - -o ${img}.pipe.binary.pgm
+done
+
+# Test reading concatenated frames from a pipe
+for img in "lena92.binary.pgm" "haus.binary.ppm" "haus.ascii.ppm"
+do
+  echo "Read 3 frames of image: ${img} from stdin; write image: frames.${img}"
+  cat ../images/${img} ../images/${img} ../images/${img} | ../bin/rnwimg.exe -f -i - -o frames.${img}
+  ../bin/rnwimg.exe -i ../images/${img} -o single.${img}
+  cat single.${img} single.${img} single.${img} | cmp - frames.${img} || echo "Error: frames.${img} differs"
+done
+
 # Test ASCII PPM (P3)
 for img in "haus" "ppmex255"
 #for img in "haus" "ppmex1" "ppmex255" # Imagine may not read ppmex1 properly!
@@ -36,13 +60,102 @@ do
   ../bin/rnwimg.exe -i ../images/${img}.ascii.ppm -o ${img}.out.ascii.ppm
 done
 
+# Test multi-threaded decoding and encoding of ASCII PPM (P3)
+for img in "haus"
+do
+  echo "Read and write image: ${img}.ascii.ppm with 4 threads; write image: ${img}.mt.ascii.ppm"
+  ../bin/rnwimg.exe -i ../images/${img}.ascii.ppm -o ${img}.mt.ascii.ppm -t 4
+  cmp ${img}.out.ascii.ppm ${img}.mt.ascii.ppm || echo "Error: ${img}.mt.ascii.ppm differs"
+done
+
 # Test binary PPM (P6)
-for img in "haus" "ppmex255" "blocks" "fruit" "prague" "squares"
+for img in "haus" "ppmex255" "blocks" "fruit" "prague" "squares" "ramp16"
 do
   echo "Read image: ${img}.binary.ppm; write image: ${img}.out.binary.ppm"
   ../bin/rnwimg.exe -i ../images/${img}.binary.ppm -o ${img}.out.binary.ppm
 done
 
+# Test PAM (P7) with an alpha channel, as generated by randimg
+for variant in "rgb" "greyscale"
+do
+  echo "Generate image: randimg.${variant}.pam; write image: randimg.${variant}.out.pam"
+  ../bin/randimg.exe -x 64 -y 48 -pam -${variant} -o randimg.${variant}.pam
+  ../bin/rnwimg.exe -i randimg.${variant}.pam -o randimg.${variant}.out.pam
+  cmp randimg.${variant}.pam randimg.${variant}.out.pam || echo "Error: randimg.${variant}.out.pam differs"
+done
+
+# Test reading and writing through aligned buffers with padded rows
+for img in "feep.binary.pgm" "ramp16.binary.pgm" "fruit.binary.ppm" "haus.ascii.ppm" "cornellbox_uniform_direct.pfm"
+do
+  echo "Read and write image: ${img} through an aligned buffer; write image: aligned.${img}"
+  ../bin/rnwimg.exe -i ../images/${img} -o plain.${img}
+  ../bin/rnwimg.exe -a -i ../images/${img} -o aligned.${img}
+  cmp plain.${img} aligned.${img} || echo "Error: aligned.${img} differs"
+done
+
+# Test reading and writing in bands of rows
+for img in "fruit.binary.ppm" "lena.ascii.pgm" "ramp16.binary.pgm" "cornellbox_uniform_direct.pfm"
+do
+  echo "Read and write image: ${img} 7 rows at a time; write image: rows.${img}"
+  ../bin/rnwimg.exe -i ../images/${img} -o plain.${img}
+  ../bin/rnwimg.exe -r 7 -i ../images/${img} -o rows.${img}
+  cmp plain.${img} rows.${img} || echo "Error: rows.${img} differs"
+  cat ../images/${img} | ../bin/rnwimg.exe -r 7 -i - -o - | cmp - plain.${img} || echo "Error: piped rows.${img} differs"
+done
+
+# Test enlarged output, written with 1 and 4 threads
+printf "P5\n2 1\n255\n\001\002" > tiny.pgm
+printf "P5\n6 2\n255\n\001\001\001\002\002\002\001\001\001\002\002\002" > tiny.3x2.pgm
+../bin/rnwimg.exe -x 3 -y 2 -i tiny.pgm -o tiny.out.3x2.pgm
+cmp tiny.3x2.pgm tiny.out.3x2.pgm || echo "Error: tiny.out.3x2.pgm differs"
+rm -f tiny.pgm tiny.3x2.pgm tiny.out.3x2.pgm
+for img in "feep.ascii.pbm" "lena.ascii.pgm" "haus.ascii.ppm" "fruit.binary.ppm"
+do
+  echo "Read image: ${img}; write image: scaled.${img} enlarged 3x2"
+  ../bin/rnwimg.exe -x 3 -y 2 -i ../images/${img} -o scaled.${img}
+  ../bin/rnwimg.exe -x 3 -y 2 -t 4 -i ../images/${img} -o scaled.mt.${img}
+  cmp scaled.${img} scaled.mt.${img} || echo "Error: scaled.mt.${img} differs"
+done
+
+# Test that an unknown magic number is reported as unsupported, and a broken
+# one as malformed.
+printf "P8\n2 1\n255\n\001\002" | ../bin/rnwimg.exe -r 7 -i - -o /dev/null 2>&1 | 
+  grep -q "unsupported" || echo "Error: P8 not reported as unsupported"
+printf "Q5\n2 1\n255\n\001\002" | ../bin/rnwimg.exe -r 7 -i - -o /dev/null 2>&1 | 
+  grep -q "malformed" || echo "Error: Q5 not reported as malformed"
+
+# Test copying a PFM written by randimg with the legacy functions and in 
+# bands through pnm_reader
+echo "Generate image: randimg.pfm; write images: randimg.out.pfm, randimg.rows.pfm"
+../bin/randimg.exe -x 64 -y 48 -pfm -rgb -o randimg.pfm > /dev/null
+../bin/rnwimg.exe -i randimg.pfm -o randimg.out.pfm
+../bin/rnwimg.exe -r 7 -i randimg.pfm -o randimg.rows.pfm
+cmp randimg.pfm randimg.out.pfm || echo "Error: randimg.out.pfm differs"
+cmp randimg.pfm randimg.rows.pfm || echo "Error: randimg.rows.pfm differs"
+
+# Test a sparse 66000x66000 PGM (over 4 GB), copied 256 rows at a time
+echo "Read and write image: huge.binary.pgm (66000x66000) 256 rows at a time"
+printf "P5\n66000 66000\n255\n" > huge.binary.pgm
+truncate -s $((66000*66000 + $(stat -c %s huge.binary.pgm))) huge.binary.pgm
+../bin/rnwimg.exe -r 256 -i huge.binary.pgm -o - | cmp - huge.binary.pgm || echo "Error: huge.binary.pgm differs"
+rm -f huge.binary.pgm
+
+# Test that headers of rasters too large to address are refused
+printf "P7\nWIDTH 2000000000\nHEIGHT 2000000000\nDEPTH 2000000000\nMAXVAL 255\nENDHDR\n" > oversized.pam
+if ../bin/rnwimg.exe -i oversized.pam -o oversized.out.pam 2> /dev/null
+then
+  echo "Error: oversized.pam accepted"
+fi
+rm -f oversized.pam oversized.out.pam
+
+# Test I/O statistics
+for img in "lena"
+do
+  echo "Read and write image: ${img}.ascii.pgm with statistics; write image: ${img}.stats.ascii.pgm"
+  ../bin/rnwimg.exe -s -i ../images/${img}.ascii.pgm -o ${img}.stats.ascii.pgm
+  cmp ${img}.out.ascii.pgm ${img}.stats.ascii.pgm || echo "Error: ${img}.stats.ascii.pgm differs"
+done
+
 # Test color PFM (PF)
 for img in "cornellbox_uniform_direct"
 do